@@ -0,0 +1,48 @@
+// Microbenchmarks of the stencils of the converter, on ASTs built in memory.
+// Unlike timing the whole tool, a regression in a single stencil shows up here
+// on its own.
+#define C_STYLE_ARRAY_CONVERTER_NO_MAIN
+#include "c_style_array_converter_tool.cpp"
+
+#include <benchmark/benchmark.h>
+
+/// Evaluate Stencil on N constant arrays of different sizes, bound to "array"
+/// and "arrayDecl" like in the FindArrays rule
+static void evalAll(benchmark::State &State, const NodeOps::resType &Stencil) {
+	std::string Code;
+	for (int64_t I = 0; I < State.range(0); ++I) {
+		Code += "int a" + std::to_string(I) + "[" + std::to_string(I + 1) +
+		        "];\n";
+	}
+	auto AST = buildASTFromCodeWithArgs(Code, {"-std=c++17"});
+	auto &Context = AST->getASTContext();
+	auto Matches =
+	    match(declaratorDecl(hasType(constantArrayType().bind("array")))
+	              .bind("arrayDecl"),
+	          Context);
+
+	for (auto _ : State) {
+		for (const auto &Nodes : Matches) {
+			auto Text = Stencil(MatchFinder::MatchResult(Nodes, &Context));
+			if (!Text) {
+				consumeError(Text.takeError());
+				State.SkipWithError("Stencil failed");
+				return;
+			}
+			benchmark::DoNotOptimize(*Text);
+		}
+	}
+	State.SetItemsProcessed(State.iterations() * Matches.size());
+}
+
+static void BM_getConstArraySize(benchmark::State &State) {
+	evalAll(State, NodeOps::getConstArraySize("array"));
+}
+BENCHMARK(BM_getConstArraySize)->Arg(100)->Arg(10000);
+
+static void BM_getArrayElemtType(benchmark::State &State) {
+	evalAll(State, NodeOps::getArrayElemtType("array"));
+}
+BENCHMARK(BM_getArrayElemtType)->Arg(100)->Arg(10000);
+
+BENCHMARK_MAIN();
@@ -1,7 +1,13 @@
+#include "../change_log/change_log.h"
+#include "../token_prefilter/token_prefilter.h"
+#include "../tool_support/tool_support.h"
+
 // Declares clang::SyntaxOnlyAction.
 #include "clang/ASTMatchers/ASTMatchersMacros.h"
-#include "clang/Frontend/TextDiagnosticPrinter.h"
-#include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Index/USRGeneration.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Refactoring.h"
 #include "clang/Tooling/Transformer/RewriteRule.h"
@@ -10,11 +16,27 @@
 #include "clang/Tooling/Transformer/Transformer.h"
 
 // Declares llvm::cl::extrahelp.
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <map>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -26,6 +48,9 @@ using ::clang::transformer::node;
 using transformer::name;
 using transformer::noopEdit;
 
+// The driver includes this file for its rules only, next to a tool that
+// provides the rest
+#ifndef C_STYLE_ARRAY_CONVERTER_RULES_ONLY
 #define append_file_line(arg) append_file_line_impl(arg, __FILE__, __LINE__)
 
 std::string append_file_line_impl(const std::string &what, const char *file,
@@ -34,47 +59,708 @@ std::string append_file_line_impl(const std::string &what, const char *file,
 	       "\n";
 }
 
+static llvm::cl::OptionCategory MyToolCategory("my-tool options");
+static llvm::cl::opt<unsigned> Jobs(
+    "j",
+    llvm::cl::desc("Number of translation units to process in parallel. 0 "
+                   "uses all available cores. The threads take the "
+                   "translation units in order from one shared queue, "
+                   "without work stealing. The metadata of the matches is "
+                   "printed in the order of the files."),
+    llvm::cl::init(1), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> PCHCache(
+    "pch_cache",
+    llvm::cl::desc("Directory for precompiled preambles. The #includes at the "
+                   "top of each file are precompiled once per unique set of "
+                   "includes and compile flags, and reused by other files and "
+                   "later runs. Disabled if not specified."),
+    llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ResultCacheDir(
+    "result_cache",
+    llvm::cl::desc("Directory for the changes generated for each file. Files "
+                   "whose contents, includes and compile command are unchanged "
+                   "since a previous run with the same --light_parse and "
+                   "--use_index reuse its changes instead of being parsed. "
+                   "Disabled if not specified."),
+    llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> LightParse(
+    "light_parse",
+    llvm::cl::desc("Skip the function bodies outside of <file>s, and with them "
+                   "most template instantiations. The rules only look at "
+                   "declarations in <file>s, so the output is the same."),
+    llvm::cl::cat(MyToolCategory));
+// The prefilter only reads the bytes of the main file. It neither expands
+// macros nor resolves types, so a file whose only arrays are declared with an
+// array typedef from a header, e.g. `Buffer B;` for `typedef char Buffer[64];`,
+// or with a macro from a header, is skipped.
+static llvm::cl::opt<bool> Prefilter(
+    "prefilter",
+    llvm::cl::desc("Skip the <file>s that contain no [ outside of comments and "
+                   "literals, without parsing them. Misses the arrays that "
+                   "only come from macros or array typedefs defined in other "
+                   "files. Not used with --use_index, which converts arrays "
+                   "in headers."),
+    llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> TraceFile(
+    "trace",
+    llvm::cl::desc("Write a Chrome trace of the run to <file.json>, with the "
+                   "frontend's own scopes next to the parsing, matching, "
+                   "stencils and writing of the tool. Open it in "
+                   "chrome://tracing or ui.perfetto.dev."),
+    llvm::cl::value_desc("file.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ProfileMatchers(
+    "profile_matchers",
+    llvm::cl::desc("Profile the matchers of each rule. When done, prints the "
+                   "time spent and the number of matches per rule, and writes "
+                   "them to <file.json>."),
+    llvm::cl::value_desc("file.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> BuildIndex(
+    "build_index",
+    llvm::cl::desc("First pass of the cross file conversion. Index the "
+                   "declarations, definitions and calls of the functions with "
+                   "C-style array parameters in all <file>s, and write the "
+                   "index to <index.json> instead of converting anything."),
+    llvm::cl::value_desc("index.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> UseIndex(
+    "use_index",
+    llvm::cl::desc("Second pass of the cross file conversion. Rewrite the "
+                   "array parameters of the functions in <index.json> in "
+                   "headers too, and only parse the <file>s with something to "
+                   "convert."),
+    llvm::cl::value_desc("index.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> Shard(
+    "shard",
+    llvm::cl::desc("Only process the <file>s of shard i out of N, e.g. 0/4, to "
+                   "spread a run over several processes or machines. Files "
+                   "are assigned to shards by a hash of their path. Requires "
+                   "--shard_output."),
+    llvm::cl::value_desc("i/N"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ShardOutput(
+    "shard_output",
+    llvm::cl::desc("Write the changes to <file> as a change log instead of "
+                   "applying them. The changes of all shards are applied with "
+                   "--merge or apply_changes."),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::list<std::string> MergeFiles(
+    "merge",
+    llvm::cl::desc("Apply the changes written by the --shard_output of all "
+                   "shards. Changes to headers found by several shards are "
+                   "applied once. Takes no <file>s."),
+    llvm::cl::value_desc("files"), llvm::cl::CommaSeparated,
+    llvm::cl::cat(MyToolCategory));
+
+struct MyConsumer {
+	MyConsumer(AtomicChanges &Changes, std::string &Metadata)
+	    : Changes(Changes), Metadata(Metadata) {}
+
+	/// Consumer for the rule called Rule
+	auto RefactorConsumer(StringRef Rule) {
+		return [this, Rule = Rule.str()](
+		           Expected<TransformerResult<std::string>> C) {
+			TimeTraceScope Scope("Consumer", Rule);
+			if (not C) {
+				throw std::runtime_error(
+				    append_file_line("Error generating changes: " +
+				                     llvm::toString(C.takeError()) + "\n"));
+			}
+			// Collect the metadata of the change, to be printed once the
+			// translation unit is done
+			Metadata += C.get().Metadata + "\n";
+			// Save the changes to be handled later
+			Changes.reserve(Changes.size() + C.get().Changes.size());
+			std::move(C.get().Changes.begin(), C.get().Changes.end(),
+			          std::back_inserter(Changes));
+
+			// Debug info
+			/*
+			            std::cout << "Changes:" << std::endl;
+			            for (auto changes: C.get().Changes) {
+
+			                std::cout << changes.toYAMLString() << std::endl;
+			            }
+			*/
+		};
+	}
+
+   private:
+	AtomicChanges &Changes;
+	std::string &Metadata;
+};
+
+using RuleType = transformer::RewriteRuleWith<std::string>;
+
+/// A rule and the name it is reported by
+struct NamedRule {
+	std::string Name;
+	RuleType Rule;
+	/// The rule only matches if the main file contains one of these, see
+	/// --prefilter. Empty if it can match without, e.g. in headers.
+	std::vector<std::string> Tokens = {};
+};
+
+/// Absolute path of File without "." and "..", so the paths seen by different
+/// translation units and given on the command line compare equal. Relative
+/// paths seen while parsing are relative to the working directory of Files.
+std::string normalizePath(StringRef File, const FileManager *Files = nullptr) {
+	SmallString<256> Path(File);
+	if (Files) {
+		Files->makeAbsolutePath(Path);
+	} else {
+		sys::fs::make_absolute(Path);
+	}
+	sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+	return Path.str().str();
+}
+
+/// True if Param is a C-style array parameter, i.e. a constant array adjusted
+/// to a pointer
+bool isArrayParam(const ParmVarDecl *Param) {
+	auto *Decayed = Param->getType()->getAs<DecayedType>();
+	return Decayed && Decayed->getOriginalType()->isConstantArrayType();
+}
+
+/// USR -> {declarations, definitions, call sites} of the functions with
+/// C-style array parameters, over all translation units. Without it, a
+/// declaration in a header and its definition in a source file cannot be
+/// rewritten together, as each translation unit only rewrites its main file.
+///
+/// Built by a first pass over all the translation units, and written as JSON:
+///   {"translation_units": ["/src/a.cpp", ...],
+///    "functions": {"<usr>": {"declarations": {"/src/a.h:3:6": 0},
+///                            "definitions": {...}, "calls": {...}}}}
+/// Each location refers to the translation unit that rewrites it. The second
+/// pass only parses the translation units listed.
+class ArrayParamIndex {
+   public:
+	enum Kind { Declaration, Definition, Call };
+
+	/// Record that the translation unit TU sees USR at Loc
+	/// \returns false if Loc was already known
+	bool add(Kind K, StringRef USR, StringRef Loc, StringRef TU) {
+		auto &Locations = Functions[USR.str()].get(K);
+		auto [It, Inserted] = Locations.try_emplace(Loc.str(), TU.str());
+		// Any of the translation units including Loc can rewrite it. Pick the
+		// same one whatever order they are indexed in.
+		if (!Inserted && TU < It->second) {
+			It->second = TU.str();
+		}
+		return Inserted;
+	}
+
+	/// Never rewrite USR, e.g. as it is declared in a system header
+	void exclude(StringRef USR) { Excluded.insert(USR); }
+
+	/// Record that TU has arrays for makeFindArrays in its main file
+	void addArrays(StringRef TU) { ArrayTUs.insert(TU.str()); }
+
+	/// USRs of the functions whose array parameters can be rewritten
+	StringSet<> usrs() const {
+		StringSet<> USRs;
+		for (const auto &[USR, Function] : Functions) {
+			if (!Excluded.contains(USR)) {
+				USRs.insert(USR);
+			}
+		}
+		return USRs;
+	}
+
+	/// The translation units the second pass must parse
+	std::set<std::string> translationUnits() const {
+		auto TUs = ArrayTUs;
+		for (const auto &[USR, Function] : Functions) {
+			if (Excluded.contains(USR)) {
+				continue;
+			}
+			for (auto K : {Declaration, Definition, Call}) {
+				for (const auto &[Loc, TU] : Function.get(K)) {
+					TUs.insert(TU);
+				}
+			}
+		}
+		return TUs;
+	}
+
+	void printStats(raw_ostream &OS) const {
+		OS << "Indexed " << usrs().size()
+		   << " functions with C-style array parameters in "
+		   << translationUnits().size() << " translation units to rewrite\n";
+	}
+
+	Error write(StringRef File) const {
+		// The locations refer to the translation units by position
+		auto TUs = translationUnits();
+		std::map<StringRef, int64_t> TUIds;
+		for (const auto &TU : TUs) {
+			TUIds.emplace(TU, TUIds.size());
+		}
+
+		return writeToOutput(File, [&](raw_ostream &Out) {
+			json::OStream JSON(Out);
+			JSON.object([&] {
+				JSON.attributeArray("translation_units", [&] {
+					for (const auto &TU : TUs) {
+						JSON.value(TU);
+					}
+				});
+				JSON.attributeObject("functions", [&] {
+					for (const auto &[USR, Function] : Functions) {
+						if (Excluded.contains(USR)) {
+							continue;
+						}
+						JSON.attributeObject(USR, [&] {
+							for (auto K : {Declaration, Definition, Call}) {
+								JSON.attributeObject(KindNames[K], [&] {
+									for (const auto &[Loc, TU] :
+									     Function.get(K)) {
+										JSON.attribute(Loc, TUIds.at(TU));
+									}
+								});
+							}
+						});
+					}
+				});
+			});
+			return Error::success();
+		});
+	}
+
+	static Expected<ArrayParamIndex> read(StringRef File) {
+		auto Buffer = MemoryBuffer::getFile(File);
+		if (!Buffer) {
+			return createFileError(File, Buffer.getError());
+		}
+		auto Root = json::parse((*Buffer)->getBuffer());
+		if (!Root) {
+			return createFileError(File, Root.takeError());
+		}
+		auto Invalid = [&] {
+			return createFileError(
+			    File, createStringError(inconvertibleErrorCode(),
+			                            "not an array parameter index"));
+		};
+
+		const auto *Object = Root->getAsObject();
+		const auto *TUs =
+		    Object ? Object->getArray("translation_units") : nullptr;
+		const auto *Functions =
+		    Object ? Object->getObject("functions") : nullptr;
+		if (!TUs || !Functions) {
+			return Invalid();
+		}
+
+		ArrayParamIndex Index;
+		std::vector<std::string> TUNames;
+		for (const auto &TU : *TUs) {
+			auto Name = TU.getAsString();
+			if (!Name) {
+				return Invalid();
+			}
+			TUNames.push_back(Name->str());
+			// Keeps the translation units without array parameters
+			Index.addArrays(*Name);
+		}
+		for (const auto &[USR, Value] : *Functions) {
+			const auto *Function = Value.getAsObject();
+			if (!Function) {
+				return Invalid();
+			}
+			for (auto K : {Declaration, Definition, Call}) {
+				const auto *Locations = Function->getObject(KindNames[K]);
+				if (!Locations) {
+					return Invalid();
+				}
+				for (const auto &[Loc, Id] : *Locations) {
+					auto I = Id.getAsInteger();
+					if (!I || *I < 0 || *I >= int64_t(TUNames.size())) {
+						return Invalid();
+					}
+					Index.add(K, USR, Loc, TUNames[*I]);
+				}
+			}
+		}
+		return Index;
+	}
+
+   private:
+	static constexpr const char *KindNames[] = {"declarations", "definitions",
+	                                            "calls"};
+
+	/// Location (file:line:col) -> translation unit rewriting it, per kind
+	struct Locations {
+		std::map<std::string, std::string> ByKind[3];
+
+		std::map<std::string, std::string> &get(Kind K) { return ByKind[K]; }
+		const std::map<std::string, std::string> &get(Kind K) const {
+			return ByKind[K];
+		}
+	};
+
+	// Sorted, so the index is the same whatever the order of the
+	// translation units
+	std::map<std::string, Locations> Functions;
+	std::set<std::string> ArrayTUs;
+	StringSet<> Excluded;
+};
+
+/// First pass of the cross translation unit conversion. Fills an
+/// ArrayParamIndex, and warns about the call sites that pass something the
+/// second pass does not convert to an std::array.
+class ArrayParamIndexer : public MatchFinder::MatchCallback {
+   public:
+	explicit ArrayParamIndexer(ArrayParamIndex &Index) : Index(Index) {}
+
+	void registerMatchers(MatchFinder &Finder) {
+		// Also matches function pointer parameters, see isArrayParam
+		auto Candidate = functionDecl(
+		    unless(isImplicit()),
+		    hasAnyParameter(parmVarDecl(hasType(decayedType()))));
+		Finder.addMatcher(Candidate.bind("function"), this);
+		Finder.addMatcher(
+		    callExpr(callee(Candidate.bind("callee"))).bind("call"), this);
+		Finder.addMatcher(
+		    cxxConstructExpr(hasDeclaration(Candidate.bind("callee")))
+		        .bind("call"),
+		    this);
+		// The arrays converted by makeFindArrays
+		Finder.addMatcher(
+		    declaratorDecl(isExpansionInMainFile(),
+		                   hasType(constantArrayType()))
+		        .bind("array"),
+		    this);
+	}
+
+	void run(const MatchFinder::MatchResult &Result) override {
+		const auto &SM = *Result.SourceManager;
+		auto TU = normalizePath(
+		    SM.getFilename(SM.getLocForStartOfFile(SM.getMainFileID())),
+		    &SM.getFileManager());
+
+		if (Result.Nodes.getNodeAs<DeclaratorDecl>("array")) {
+			Index.addArrays(TU);
+			return;
+		}
+		if (const auto *Call = Result.Nodes.getNodeAs<Expr>("call")) {
+			const auto *Callee = Result.Nodes.getNodeAs<FunctionDecl>("callee");
+			auto USR = getUSR(Callee);
+			if (USR.empty() || !hasArrayParam(Callee)) {
+				return;
+			}
+			auto Loc = location(Call->getBeginLoc(), SM);
+			if (!Index.add(ArrayParamIndex::Call, USR, Loc, TU)) {
+				return;
+			}
+			if (const auto *C = dyn_cast<CallExpr>(Call)) {
+				// The object of a member operator is its first argument
+				if (!isa<CXXOperatorCallExpr>(C)) {
+					checkArguments(Callee, {C->getArgs(), C->getNumArgs()},
+					               Loc, SM);
+				}
+			} else if (const auto *C = dyn_cast<CXXConstructExpr>(Call)) {
+				checkArguments(Callee, {C->getArgs(), C->getNumArgs()}, Loc,
+				               SM);
+			}
+			return;
+		}
+
+		const auto *Function = Result.Nodes.getNodeAs<FunctionDecl>("function");
+		auto USR = getUSR(Function);
+		if (USR.empty() || !hasArrayParam(Function)) {
+			return;
+		}
+		if (SM.isInSystemHeader(SM.getExpansionLoc(Function->getLocation()))) {
+			Index.exclude(USR);
+			return;
+		}
+		Index.add(Function->isThisDeclarationADefinition()
+		              ? ArrayParamIndex::Definition
+		              : ArrayParamIndex::Declaration,
+		          USR, location(Function->getLocation(), SM), TU);
+	}
+
+   private:
+	static std::string getUSR(const Decl *D) {
+		SmallString<128> USR;
+		if (clang::index::generateUSRForDecl(D, USR)) {
+			return "";
+		}
+		return USR.str().str();
+	}
+
+	static bool hasArrayParam(const FunctionDecl *Function) {
+		return llvm::any_of(Function->parameters(), isArrayParam);
+	}
+
+	static std::string location(SourceLocation Loc, const SourceManager &SM) {
+		auto FileLoc = SM.getFileLoc(Loc);
+		return normalizePath(SM.getFilename(FileLoc), &SM.getFileManager()) +
+		       ":" +
+		       std::to_string(SM.getSpellingLineNumber(FileLoc)) + ":" +
+		       std::to_string(SM.getSpellingColumnNumber(FileLoc));
+	}
+
+	/// Warn about the arguments for array parameters that will not be
+	/// converted to std::array, as the call would no longer compile
+	static void checkArguments(const FunctionDecl *Callee,
+	                           ArrayRef<const Expr *> Args, StringRef Loc,
+	                           const SourceManager &SM) {
+		for (size_t I = 0; I < Args.size() && I < Callee->getNumParams();
+		     ++I) {
+			if (isArrayParam(Callee->getParamDecl(I)) &&
+			    !isConverted(Args[I]->IgnoreParenImpCasts(), SM)) {
+				llvm::errs() << Loc << ": warning: argument " << I + 1
+				             << " of " << Callee->getQualifiedNameAsString()
+				             << " is not converted to std::array\n";
+			}
+		}
+	}
+
+	static bool isConverted(const Expr *Arg, const SourceManager &SM) {
+		const ValueDecl *D = nullptr;
+		if (const auto *Ref = dyn_cast<DeclRefExpr>(Arg)) {
+			D = Ref->getDecl();
+		} else if (const auto *Member = dyn_cast<MemberExpr>(Arg)) {
+			D = Member->getMemberDecl();
+		}
+		if (!D || SM.isInSystemHeader(SM.getExpansionLoc(D->getLocation()))) {
+			return false;
+		}
+		// Array parameters become references to std::array themselves
+		if (const auto *Param = dyn_cast<ParmVarDecl>(D)) {
+			return isArrayParam(Param);
+		}
+		// makeFindArrays only converts the arrays in the main files
+		return D->getType()->isConstantArrayType() &&
+		       SM.isInMainFile(SM.getExpansionLoc(D->getLocation()));
+	}
+
+	ArrayParamIndex &Index;
+};
+
 struct ArrayRefactoringTool : public ClangTool {
 	ArrayRefactoringTool(
 	    const CompilationDatabase &Compilations,
 	    ArrayRef<std::string> SourcePaths,
 	    std::shared_ptr<PCHContainerOperations> PCHContainerOps =
 	        std::make_shared<PCHContainerOperations>())
-	    : ClangTool(Compilations, SourcePaths, std::move(PCHContainerOps)) {}
+	    : ClangTool(Compilations, SourcePaths, PCHContainerOps),
+	      Compilations(Compilations),
+	      SourcePaths(SourcePaths),
+	      PCHContainerOps(std::move(PCHContainerOps)) {}
 
 	/// Return a reference to the current changes
 	AtomicChanges &getChanges() { return Changes; }
 
-	/// Call run(), apply all generated replacements, and immediately save
-	/// the results to disk.
+	/// Append an arguments adjuster. Unlike ClangTool's, the adjuster is also
+	/// used by the tools created for each translation unit by runParallel.
+	void appendArgumentsAdjuster(ArgumentsAdjuster Adjuster) {
+		Adjusters.push_back(Adjuster);
+		ClangTool::appendArgumentsAdjuster(std::move(Adjuster));
+	}
+
+	/// Reuse the precompiled preambles stored in Dir. See
+	/// tool_support::PreambleCache.
+	void usePreambleCache(StringRef Dir) {
+		Preambles = std::make_unique<tool_support::PreambleCache>(
+		    Dir, PCHContainerOps);
+		appendArgumentsAdjuster(Preambles->getAdjuster());
+	}
+
+	/// Only parse the function bodies in the main files. Must be called before
+	/// usePreambleCache, so the preambles skip the bodies too.
+	void useLightParse() {
+		appendArgumentsAdjuster(getInsertArgumentAdjuster(
+		    {"-Xclang", "-skip-function-bodies"}, ArgumentInsertPosition::END));
+	}
+
+	/// Reuse the changes stored in Dir for unchanged translation units that
+	/// ran with the same Config. See tool_support::ResultCache.
+	void useResultCache(StringRef Dir, StringRef Config) {
+		Results = std::make_unique<tool_support::ResultCache>(
+		    Dir, Compilations, Config);
+	}
+
+	/// Profile the matchers of each rule, and report them to stderr and
+	/// JSONFile once the rules ran. See tool_support::MatcherProfile.
+	void profileMatchers(StringRef JSONFile) {
+		Profile = std::make_unique<tool_support::MatcherProfile>(JSONFile);
+	}
+
+	/// Drop the changes generated more than once. Needed when headers are
+	/// rewritten, as every translation unit including them rewrites them.
+	void deduplicateChanges() { Deduplicate = true; }
+
+	/// First pass of the cross translation unit conversion: index the
+	/// functions with C-style array parameters of all source files, and write
+	/// the index to File. See ArrayParamIndex.
 	///
 	/// \returns 0 upon success. Non-zero upon failure.
-	int runAndSave(FrontendActionFactory *ActionFactory) {
-		if (int Result = run(ActionFactory)) {
+	int buildIndex(StringRef File) {
+		ArrayParamIndex Index;
+		ArrayParamIndexer Indexer(Index);
+		MatchFinder Finder;
+		Indexer.registerMatchers(Finder);
+		if (int Result = run(newFrontendActionFactory(&Finder).get())) {
 			return Result;
 		}
 
-		LangOptions DefaultLangOptions;
-		IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts =
-		    new DiagnosticOptions();
-		TextDiagnosticPrinter DiagnosticPrinter(llvm::errs(), &*DiagOpts);
-		DiagnosticsEngine Diagnostics(
-		    IntrusiveRefCntPtr<DiagnosticIDs>(new DiagnosticIDs()), &*DiagOpts,
-		    &DiagnosticPrinter, false);
+		Index.printStats(llvm::errs());
+		if (auto Err = Index.write(File)) {
+			llvm::errs() << "Could not write the index: "
+			             << toString(std::move(Err)) << "\n";
+			return 1;
+		}
+		return 0;
+	}
 
-		SourceManager Sources(Diagnostics, getFiles());
-		Rewriter Rewrite(Sources, DefaultLangOptions);
+	/// Run the rules on all source files, apply all generated replacements,
+	/// and immediately save the results to disk.
+	///
+	/// \returns 0 upon success. Non-zero upon failure.
+	int runAndSave(ArrayRef<NamedRule> Rules) {
+		// The result cache and the prefilter work per translation unit, like
+		// runParallel
+		int Result = 0;
+		if (Jobs == 1 && !Results && !Prefilter) {
+			std::string Metadata;
+			Result = runRules(*this, Rules, Changes, Metadata);
+			std::cout << Metadata;
+		} else {
+			Result = runParallel(Rules);
+		}
+		if (Profile) {
+			Profile->report(llvm::errs());
+		}
+		if (Result) {
+			return Result;
+		}
+		if (!ChangesFile.empty()) {
+			return writeChanges() ? 0 : 1;
+		}
 
-		return applyAllChanges(Rewrite) ? 0 : 1;
+		return applyAllChanges() ? 0 : 1;
 	}
 
-	/// @brief Apply all the saved changes to the rewriter
-	/// @param Rewrite - the rewriter to use
-	/// @return true if sucessfull
-	bool applyAllChanges(Rewriter &Rewrite) {
-		auto &sm = Rewrite.getSourceMgr();
-		auto &fm = sm.getFileManager();
+	/// Write the changes to File instead of applying them. See --shard.
+	void writeChangesTo(StringRef File) { ChangesFile = File.str(); }
+
+	/// Add the changes written to Files by writeChangesTo. Identical changes,
+	/// e.g. to a header included by the files of several shards, are only
+	/// added once.
+	/// \returns false if a file could not be read
+	bool mergeChanges(ArrayRef<std::string> Files) {
+		auto Logs = change_log::ChangeLogSet::open(Files);
+		if (!Logs) {
+			llvm::errs() << toString(Logs.takeError()) << "\n";
+			return false;
+		}
+		for (size_t F = 0; F < Logs->files(); ++F) {
+			auto Path = Logs->getFilePath(F);
+			auto Code = MemoryBuffer::getFile(Path);
+			if (!Code) {
+				llvm::errs() << "Could not read " << Path << ": "
+				             << Code.getError().message() << "\n";
+				return false;
+			}
+			if (auto Err =
+			        Logs->appendChanges(F, (*Code)->getBuffer(), Changes)) {
+				llvm::errs() << toString(std::move(Err)) << "\n";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/// @brief Run the rules on every source file using a pool of `Jobs`
+	/// threads. Each translation unit gets its own ClangTool, MatchFinder and
+	/// change set, since none of them are thread safe. The translation
+	/// units are queued in order on the shared FIFO queue of llvm::ThreadPool,
+	/// which has no work stealing: an idle thread takes the next queued one,
+	/// so a few large files only stall the run if they are queued last.
+	/// Translation units found in the result cache are not parsed at all.
+	/// @param Rules - the rules to run on every translation unit
+	/// @return the same result code as ClangTool::run
+	int runParallel(ArrayRef<NamedRule> Rules) {
+		std::vector<AtomicChanges> TUChanges(SourcePaths.size());
+		std::vector<std::string> TUMetadata(SourcePaths.size());
+		std::vector<int> TUResults(SourcePaths.size(), 0);
+
+		std::optional<token_prefilter::TokenPrefilter> Filter;
+		if (Prefilter) {
+			Filter = token_prefilter::makePrefilter(Rules);
+		}
+		std::atomic<size_t> Skipped = 0;
+
+		llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+		for (size_t I = 0; I < SourcePaths.size(); ++I) {
+			Pool.async([&, I] {
+				tool_support::TaskTrace Trace(!TraceFile.empty(), "converter");
+				TimeTraceScope Scope("Translation unit", SourcePaths[I]);
+
+				// A file that cannot be read is left to the frontend
+				if (Filter) {
+					auto Code = MemoryBuffer::getFile(SourcePaths[I]);
+					if (Code && !Filter->mayMatch((*Code)->getBuffer())) {
+						++Skipped;
+						return;
+					}
+				}
 
+				if (Results) {
+					if (auto Cached = Results->replay(SourcePaths[I])) {
+						TUChanges[I] = std::move(Cached->Changes);
+						TUMetadata[I] = std::move(Cached->Metadata);
+						return;
+					}
+				}
+
+				ClangTool TUTool(Compilations, SourcePaths[I], PCHContainerOps);
+				for (const auto &Adjuster : Adjusters) {
+					TUTool.appendArgumentsAdjuster(Adjuster);
+				}
+				tool_support::CollectDependencies Deps;
+				TUResults[I] = runRules(TUTool, Rules, TUChanges[I],
+				                        TUMetadata[I], &Deps);
+				if (Results && TUResults[I] == 0) {
+					std::vector<const AtomicChange *> Stored;
+					for (const auto &Change : TUChanges[I]) {
+						Stored.push_back(&Change);
+					}
+					Results->store(SourcePaths[I], Deps.Deps->getDependencies(),
+					               Stored, TUMetadata[I]);
+				}
+			});
+		}
+		Pool.wait();
+
+		if (Filter) {
+			llvm::errs() << "Prefilter skipped " << Skipped.load() << " of "
+			             << SourcePaths.size() << " translation units\n";
+		}
+		if (Results) {
+			Results->printStats(llvm::errs());
+		}
+
+		// Merge the changes and print the metadata in the same order as a
+		// serial run
+		for (size_t I = 0; I < SourcePaths.size(); ++I) {
+			std::move(TUChanges[I].begin(), TUChanges[I].end(),
+			          std::back_inserter(Changes));
+			std::cout << TUMetadata[I];
+		}
+
+		// Same priority as ClangTool::run: failures before skipped files
+		if (llvm::is_contained(TUResults, 1)) {
+			return 1;
+		}
+		return llvm::is_contained(TUResults, 2) ? 2 : 0;
+	}
+
+	/// @brief Apply all the saved changes and write the new code back to
+	/// disk. Files are processed in parallel, and each file is written
+	/// atomically. Files whose code does not change are not written, and
+	/// nothing is written if any file fails.
+	/// @return true if sucessfull
+	bool applyAllChanges() {
 		// FIXME: Add automatic formatting support as well.
 		tooling::ApplyChangesSpec Spec;
 
@@ -82,77 +768,139 @@ struct ArrayRefactoringTool : public ClangTool {
 		Spec.Cleanup = false;
 
 		// Split the changes according to filename
-		std::unordered_map<std::string, AtomicChanges> Files;
-		for (const auto &Change : Changes)
-			Files[Change.getFilePath()].push_back(Change);
-
-		// Apply all atomic changes to all files
-		for (const auto &[File, FileChanges] : Files) {
-			// Get File from file manager
-			auto Entry = fm.getFileRef(File);
-			if (!Entry) {
-				llvm::errs() << Entry.takeError();
-				return false;
+		std::unordered_map<std::string, AtomicChanges> FileMap;
+		StringSet<> Seen;
+		for (auto &Change : Changes) {
+			if (Deduplicate && !Seen.insert(Change.toYAMLString()).second) {
+				continue;
 			}
+			FileMap[Change.getFilePath()].push_back(std::move(Change));
+		}
+		Changes.clear();
 
-			// Get the id for the file
-			auto id = sm.getOrCreateFileID(Entry.get(), SrcMgr::C_User);
-
-			// Read the current code and apply all the changes that to that file
-			auto code = sm.getBufferData(id);
-			auto new_code = applyAtomicChanges(File, code, FileChanges, Spec);
+		std::vector<std::pair<StringRef, const AtomicChanges *>> Files;
+		for (const auto &[File, FileChanges] : FileMap) {
+			Files.emplace_back(File, &FileChanges);
+		}
+		std::vector<std::string> NewCode(Files.size());
+		// Not std::vector<bool>, which the threads cannot write concurrently
+		std::vector<char> Changed(Files.size());
+		std::vector<std::string> Errors(Files.size());
 
-			if (!new_code) {
-				llvm::errs() << new_code.takeError();
-				return false;
+		// Read the current code and apply all the changes to each file.
+		// Reading and writing is mostly waiting on I/O, so use all threads.
+		llvm::ThreadPool Pool(llvm::hardware_concurrency());
+		{
+			TimeTraceScope Scope("Apply changes");
+			for (size_t I = 0; I < Files.size(); ++I) {
+				Pool.async([&, I] {
+					auto [File, FileChanges] = Files[I];
+					auto Code = MemoryBuffer::getFile(File);
+					if (!Code) {
+						Errors[I] = "Could not read " + File.str() + ": " +
+						            Code.getError().message();
+						return;
+					}
+					auto new_code = applyAtomicChanges(
+					    File, (*Code)->getBuffer(), *FileChanges, Spec);
+					if (!new_code) {
+						Errors[I] = toString(new_code.takeError());
+						return;
+					}
+					Changed[I] = *new_code != (*Code)->getBuffer();
+					NewCode[I] = std::move(new_code.get());
+				});
 			}
-
-			// Replace the entire file with the new code
-			auto fileRange = SourceRange(sm.getLocForStartOfFile(id),
-			                             sm.getLocForEndOfFile(id));
-			Rewrite.ReplaceText(fileRange, new_code.get());
+			Pool.wait();
+		}
+		if (tool_support::printErrors(Errors)) {
+			return false;
 		}
 
-		// Apply all changes to disk
-		return Rewrite.overwriteChangedFiles();
+		std::vector<std::pair<StringRef, StringRef>> Writes;
+		for (size_t I = 0; I < Files.size(); ++I) {
+			if (Changed[I]) {
+				Writes.emplace_back(Files[I].first, NewCode[I]);
+			}
+		}
+		return tool_support::writeFiles(Pool, Writes);
 	}
 
    private:
-	AtomicChanges Changes{};
-};
-
-struct MyConsumer {
-	explicit MyConsumer(AtomicChanges &Changes) : Changes(Changes) {}
+	/// Write all changes to ChangesFile as a change log
+	bool writeChanges() const {
+		change_log::ChangeLogWriter Log;
+		for (const auto &Change : Changes) {
+			Log.add(Change);
+		}
+		if (auto Err = writeToOutput(ChangesFile, [&](raw_ostream &Out) {
+			    Log.write(Out);
+			    return Error::success();
+		    })) {
+			llvm::errs() << "Could not write " << ChangesFile << ": "
+			             << toString(std::move(Err)) << "\n";
+			return false;
+		}
+		return true;
+	}
 
-	auto RefactorConsumer() {
-		return [this](Expected<TransformerResult<std::string>> C) {
-			if (not C) {
-				throw std::runtime_error(
-				    append_file_line("Error generating changes: " +
-				                     llvm::toString(C.takeError()) + "\n"));
-			}
-			// Print the metadata of the change
-			std::cout << C.get().Metadata << "\n";
-			// Save the changes to be handled later
-			Changes.reserve(Changes.size() + C.get().Changes.size());
-			std::move(C.get().Changes.begin(), C.get().Changes.end(),
-			          std::back_inserter(Changes));
+	/// Register all the rules on a fresh MatchFinder, run them through Tool
+	/// and store the generated changes in Out, and the metadata of the
+	/// matches in Metadata, a line each.
+	int runRules(ClangTool &Tool, ArrayRef<NamedRule> Rules, AtomicChanges &Out,
+	             std::string &Metadata,
+	             SourceFileCallbacks *Callbacks = nullptr) {
+		StringMap<TimeRecord> Records;
+		MatchFinder::MatchFinderOptions Options;
+		if (Profile) {
+			Options.CheckProfiling.emplace(Records);
+		}
+		MatchFinder Finder(std::move(Options));
+		MyConsumer Consumer(Out, Metadata);
 
-			// Debug info
-			/*
-			            std::cout << "Changes:" << std::endl;
-			            for (auto changes: C.get().Changes) {
+		using tool_support::NamedTransformer;
+		std::vector<std::unique_ptr<NamedTransformer>> Transformers;
+		for (const auto &Rule : Rules) {
+			Transformers.push_back(std::make_unique<NamedTransformer>(
+			    Rule.Name, Rule.Rule, Consumer.RefactorConsumer(Rule.Name)));
+			Transformers.back()->registerMatchers(&Finder);
+		}
 
-			                std::cout << changes.toYAMLString() << std::endl;
-			            }
-			*/
-		};
+		// The MatchFinder replaces the records for every translation unit
+		tool_support::MatchConsumerFactory Factory{Finder};
+		if (Profile) {
+			Factory.OnMatched = [&] {
+				for (const auto &RuleTransformer : Transformers) {
+					auto Rule = RuleTransformer->getID();
+					Profile->add(Rule, Records.lookup(Rule),
+					             RuleTransformer->takeMatches());
+				}
+				Records.clear();
+			};
+		}
+		return Tool.run(newFrontendActionFactory(&Factory, Callbacks).get());
 	}
 
-   private:
-	AtomicChanges &Changes;
+	const CompilationDatabase &Compilations;
+	std::vector<std::string> SourcePaths;
+	std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+	std::vector<ArgumentsAdjuster> Adjusters;
+	std::unique_ptr<tool_support::PreambleCache> Preambles;
+	std::unique_ptr<tool_support::ResultCache> Results;
+	std::unique_ptr<tool_support::MatcherProfile> Profile;
+	bool Deduplicate = false;
+	std::string ChangesFile;
+	AtomicChanges Changes{};
 };
 
+/// The merge step of --shard: apply the changes of all shards, once each
+int mergeAndApply(ArrayRef<std::string> ChangesFiles) {
+	FixedCompilationDatabase Compilations(".", {});
+	ArrayRefactoringTool Tool(Compilations, {});
+	return Tool.mergeChanges(ChangesFiles) && Tool.applyAllChanges() ? 0 : 1;
+}
+#endif
+
 /// Stencil for retrieving extra information of a node
 namespace NodeOps {
 
@@ -162,6 +910,7 @@ using resType = transformer::MatchConsumer<std::string>;
 /// Result
 resType getConstArraySize(StringRef Id) {
 	return [=](const MatchFinder::MatchResult &Match) -> Expected<std::string> {
+		TimeTraceScope Scope("Stencil", "getConstArraySize");
 		auto array = Match.Nodes.getNodeAs<ConstantArrayType>(Id);
 		if (!array) {
 			throw std::invalid_argument(append_file_line(
@@ -177,6 +926,7 @@ resType getConstArraySize(StringRef Id) {
 /// Matches the ID with an ArrayType and appends the type of the array to Result
 resType getArrayElemtType(StringRef Id) {
 	return [=](const MatchFinder::MatchResult &Match) -> Expected<std::string> {
+		TimeTraceScope Scope("Stencil", "getArrayElemtType");
 		auto array = Match.Nodes.getNodeAs<ArrayType>(Id);
 		if (!array) {
 			throw std::runtime_error(
@@ -190,6 +940,7 @@ resType getArrayElemtType(StringRef Id) {
 /// Appends nothing if storage class is none.
 resType getVarStorage(StringRef Id) {
 	return [=](const MatchFinder::MatchResult &Match) -> Expected<std::string> {
+		TimeTraceScope Scope("Stencil", "getVarStorage");
 		if (auto field = Match.Nodes.getNodeAs<FieldDecl>(Id)) {
 			// Ignore
 			return "";
@@ -211,6 +962,7 @@ resType getVarStorage(StringRef Id) {
 /// name to the Result. (In most cases there are no qualifiers)
 resType getDeclQualifier(StringRef Id) {
 	return [=](const MatchFinder::MatchResult &Match) -> Expected<std::string> {
+		TimeTraceScope Scope("Stencil", "getDeclQualifier");
 		auto *D = Match.Nodes.getNodeAs<DeclaratorDecl>(Id);
 		if (!D)
 			throw std::invalid_argument(append_file_line(
@@ -239,6 +991,7 @@ resType getDeclQualifier(StringRef Id) {
 /// @return
 resType getLocOfDecl(StringRef Id) {
 	return [=](const MatchFinder::MatchResult &Match) -> Expected<std::string> {
+		TimeTraceScope Scope("Stencil", "getLocOfDecl");
 		if (auto decl = Match.Nodes.getNodeAs<Decl>(Id)) {
 			return decl->getLocation().printToString(*Match.SourceManager);
 		}
@@ -259,31 +1012,24 @@ AST_MATCHER_P(AdjustedType, hasOriginalType,
               ast_matchers::internal::Matcher<QualType>, InnerType) {
 	return InnerType.matches(Node.getOriginalType(), Finder, Builder);
 }
-}  // namespace myMatcher
-
-int main(int argc, const char **argv) {
-	// Configuring the command-line options
-	llvm::cl::OptionCategory MyToolCategory("my-tool options");
-	auto ExpectedParser =
-	    CommonOptionsParser::create(argc, argv, MyToolCategory);
-	if (!ExpectedParser) {
-		// Fail gracefully for unsupported options.
-		llvm::errs() << ExpectedParser.takeError();
-		return 1;
-	}
-	CommonOptionsParser &OptionsParser = ExpectedParser.get();
 
-	// Using refactoring tool since it allows `runAndSave` instead of `run`
-	ArrayRefactoringTool Tool(OptionsParser.getCompilations(),
-	                          OptionsParser.getSourcePathList());
+/// Matches the functions whose USR is in USRs
+AST_MATCHER_P(FunctionDecl, hasUSRIn, const StringSet<> *, USRs) {
+	SmallString<128> USR;
+	return !clang::index::generateUSRForDecl(&Node, USR) &&
+	       USRs->contains(USR);
+}
+}  // namespace myMatcher
 
+/// Rule converting C-style arrays declared in the main file to std::array
+transformer::RewriteRuleWith<std::string> makeFindArrays() {
 	auto ConstArrayFinder =
 	    declaratorDecl(isExpansionInMainFile(),
 	                   hasType(constantArrayType().bind("array")),
 	                   hasTypeLoc(typeLoc().bind("arrayLoc")))
 	        .bind("arrayDecl");
 
-	auto FindArrays = makeRule(
+	return makeRule(
 	    ConstArrayFinder,
 	    {addInclude("array", transformer::IncludeFormat::Angled),
 	     changeTo(
@@ -299,20 +1045,29 @@ int main(int argc, const char **argv) {
 	             name("arrayDecl")))},
 	    cat("Changed CStyle Array: ",
 	        transformer::run(NodeOps::getLocOfDecl("arrayDecl"))));
+}
 
-	MatchFinder Finder;
-	MyConsumer Consumer(Tool.getChanges());
-
-	Transformer Transf{FindArrays, Consumer.RefactorConsumer()};
-	Transf.registerMatchers(&Finder);
+/// Rule converting C-style array parameters in the main file to references to
+/// std::array. With the USRs of an ArrayParamIndex, converts the parameters of
+/// those functions instead, in headers too.
+transformer::RewriteRuleWith<std::string> makeFindCStyleArrayParams(
+    const StringSet<> *IndexedUSRs = nullptr) {
+	// Without an index, the declarations in headers could get out of sync
+	// with their definitions
+	auto InScope =
+	    IndexedUSRs
+	        ? parmVarDecl(unless(isExpansionInSystemHeader()),
+	                      hasDeclContext(
+	                          functionDecl(myMatcher::hasUSRIn(IndexedUSRs))))
+	        : parmVarDecl(isExpansionInMainFile());
 	auto ParmConstArrays =
-	    parmVarDecl(isExpansionInMainFile(),
+	    parmVarDecl(InScope,
 	                hasType(decayedType(myMatcher::hasOriginalType(
 	                    constantArrayType().bind("parm")))),
 	                hasTypeLoc(typeLoc().bind("parmLoc")))
 	        .bind("parmDecl");
 
-	auto FindCStyleArrayParams = makeRule(
+	return makeRule(
 	    ParmConstArrays,
 	    {addInclude("array", transformer::IncludeFormat::Angled),
 	     changeTo(
@@ -328,13 +1083,131 @@ int main(int argc, const char **argv) {
 	             name("parmDecl")))},
 	    cat("Changed CStyle Array: ",
 	        transformer::run(NodeOps::getLocOfDecl("parmDecl"))));
+}
+
+// The benchmarks include this file for its stencils
+#if !defined(C_STYLE_ARRAY_CONVERTER_NO_MAIN) && \
+    !defined(C_STYLE_ARRAY_CONVERTER_RULES_ONLY)
+int main(int argc, const char **argv) {
+	// The merge step of --shard takes no source files, which the normal
+	// option parsing requires
+	for (int I = 1; I < argc; ++I) {
+		StringRef Arg(argv[I]);
+		if (Arg.startswith("-merge=") || Arg.startswith("--merge=")) {
+			if (!llvm::cl::ParseCommandLineOptions(argc, argv, "",
+			                                       &llvm::errs())) {
+				return 1;
+			}
+			return mergeAndApply(MergeFiles);
+		}
+	}
+
+	// Configuring the command-line options
+	auto ExpectedParser =
+	    CommonOptionsParser::create(argc, argv, MyToolCategory);
+	if (!ExpectedParser) {
+		// Fail gracefully for unsupported options.
+		llvm::errs() << ExpectedParser.takeError();
+		return 1;
+	}
+	CommonOptionsParser &OptionsParser = ExpectedParser.get();
+
+	if (!BuildIndex.empty() && !UseIndex.empty()) {
+		llvm::errs() << "--build_index and --use_index are separate passes\n";
+		return 1;
+	}
+	if (!Shard.empty() && ShardOutput.empty()) {
+		llvm::errs() << "--shard requires --shard_output\n";
+		return 1;
+	}
+	if (!UseIndex.empty() && !ResultCacheDir.empty()) {
+		llvm::errs() << "--use_index does not support --result_cache, as the "
+		                "cached changes do not depend on the index\n";
+		return 1;
+	}
 
-	Transformer WarnCStyleMethod{FindCStyleArrayParams,
-	                             Consumer.RefactorConsumer()};
+	// The second pass skips the files without anything to convert
+	auto Sources = OptionsParser.getSourcePathList();
+	StringSet<> IndexedUSRs;
+	if (!UseIndex.empty()) {
+		auto Index = ArrayParamIndex::read(UseIndex);
+		if (!Index) {
+			llvm::errs() << toString(Index.takeError()) << "\n";
+			return 1;
+		}
+		auto TUs = Index->translationUnits();
+		llvm::erase_if(Sources, [&](const std::string &Source) {
+			return !TUs.count(normalizePath(Source));
+		});
+		IndexedUSRs = Index->usrs();
+	}
+	// Each shard only sees its own files, so it must not apply the changes to
+	// the headers they share with other shards
+	if (!Shard.empty()) {
+		unsigned Index, Count;
+		if (!tool_support::parseShard(Shard, Index, Count)) {
+			llvm::errs() << "--shard must be i/N with i < N\n";
+			return 1;
+		}
+		llvm::erase_if(Sources, [&](const std::string &Source) {
+			return !tool_support::isInShard(Source, Index, Count);
+		});
+	}
 
-	WarnCStyleMethod.registerMatchers(&Finder);
+	// Using refactoring tool since it allows `runAndSave` instead of `run`
+	ArrayRefactoringTool Tool(OptionsParser.getCompilations(), Sources);
+	if (!UseIndex.empty()) {
+		Tool.deduplicateChanges();
+	}
+	if (!ShardOutput.empty()) {
+		Tool.writeChangesTo(ShardOutput);
+	}
+	if (LightParse) {
+		Tool.useLightParse();
+	}
+	if (!PCHCache.empty()) {
+		Tool.usePreambleCache(PCHCache);
+	}
+	if (!ResultCacheDir.empty()) {
+		// The index decides which parameters are converted
+		std::string Config =
+		    "light_parse=" + std::to_string(LightParse.getValue());
+		if (!UseIndex.empty()) {
+			Config += " use_index=" + tool_support::getFileStamp(UseIndex);
+		}
+		Tool.useResultCache(ResultCacheDir, Config);
+	}
+	if (!ProfileMatchers.empty()) {
+		Tool.profileMatchers(ProfileMatchers);
+	}
 
 	// Run the tool and save the changes on disk immediately.
 	// See clang/tools/clang-rename/ClangRename.cpp:190-237 for other options
-	return Tool.runAndSave(newFrontendActionFactory(&Finder).get());
-}
\ No newline at end of file
+	if (!TraceFile.empty()) {
+		timeTraceProfilerInitialize(0, "converter");
+	}
+	int Result = 0;
+	if (!BuildIndex.empty()) {
+		Result = Tool.buildIndex(BuildIndex);
+	} else {
+		auto *USRs = UseIndex.empty() ? nullptr : &IndexedUSRs;
+		// With an index, the parameters in headers are converted too
+		std::vector<std::string> ParamTokens;
+		if (!USRs) {
+			ParamTokens = {"["};
+		}
+		Result = Tool.runAndSave(
+		    {{"FindArrays", makeFindArrays(), {"["}},
+		     {"FindCStyleArrayParams", makeFindCStyleArrayParams(USRs),
+		      ParamTokens}});
+	}
+	if (timeTraceProfilerEnabled()) {
+		if (auto Err = timeTraceProfilerWrite(TraceFile, TraceFile)) {
+			llvm::errs() << "Could not write the trace: "
+			             << toString(std::move(Err)) << "\n";
+		}
+		timeTraceProfilerCleanup();
+	}
+	return Result;
+}
+#endif
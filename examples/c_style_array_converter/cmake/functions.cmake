@@ -31,4 +31,46 @@ function(configure_clang_lib)
     set_clang_lib("${LLVM_BUILD}" "LIB_CLANG")
     message(STATUS "Using LIB_CLANG = ${LIB_CLANG}")
     copy_lib_clang("${LIB_CLANG}")
-endfunction()
\ No newline at end of file
+endfunction()
+
+function(configure_release_build target)
+# Applies the STATIC_LTO and PGO options to target:
+#  -DSTATIC_LTO=ON                  Link the clang and LLVM libraries statically
+#                                   with ThinLTO, and keep frame pointers and
+#                                   debug symbols so perf can unwind through
+#                                   the libraries.
+#  -DPGO=GENERATE                   Instrument target to write a profile
+#  -DPGO=USE -DPGO_PROFILE=<file>   Optimize target with a merged profile
+# LTO only reaches into the libraries if LLVM was built with
+# -DLLVM_ENABLE_LTO=Thin. See pgo.sh for the two-stage PGO build.
+    if (STATIC_LTO)
+        get_target_property(clang_lib_type clangAST TYPE)
+        if (LLVM_LINK_LLVM_DYLIB OR CLANG_LINK_CLANG_DYLIB OR NOT clang_lib_type STREQUAL "STATIC_LIBRARY")
+            message(FATAL_ERROR "STATIC_LTO requires static clang and LLVM libraries. Build LLVM without BUILD_SHARED_LIBS, LLVM_LINK_LLVM_DYLIB and CLANG_LINK_CLANG_DYLIB.")
+        endif()
+        target_compile_options(${target} PRIVATE -flto=thin -g -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer)
+        target_link_options(${target} PRIVATE -flto=thin -static-libstdc++ -static-libgcc)
+        find_program(LLD_LINKER ld.lld HINTS "${LLVM_TOOLS_BINARY_DIR}")
+        if (LLD_LINKER)
+            target_link_options(${target} PRIVATE "-fuse-ld=${LLD_LINKER}")
+        endif()
+        message(STATUS "Linking ${target} statically with ThinLTO")
+    endif()
+
+    if (PGO STREQUAL "GENERATE")
+        target_compile_options(${target} PRIVATE -fprofile-generate)
+        target_link_options(${target} PRIVATE -fprofile-generate)
+    elseif (PGO STREQUAL "USE")
+        if (NOT EXISTS "${PGO_PROFILE}")
+            message(FATAL_ERROR "PGO=USE requires -DPGO_PROFILE=<file.profdata>. Unable to find \"${PGO_PROFILE}\".")
+        endif()
+        # The profile is also needed when linking, since LTO optimizes there
+        target_compile_options(${target} PRIVATE "-fprofile-use=${PGO_PROFILE}")
+        target_link_options(${target} PRIVATE "-fprofile-use=${PGO_PROFILE}")
+    elseif (PGO)
+        message(FATAL_ERROR "Unknown PGO=${PGO}. Use GENERATE or USE.")
+    endif()
+    if (PGO)
+        message(STATUS "Using PGO=${PGO} for ${target}")
+    endif()
+endfunction()
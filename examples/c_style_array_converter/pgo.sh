@@ -0,0 +1,39 @@
+#!/bin/bash
+# Two-stage PGO build of the converter, with static libraries and ThinLTO.
+# Builds an instrumented tool in build-pgo, trains it on copies of the files in
+# pgo_corpus, input_file.orig.cpp and example_project, and builds the
+# optimized tool in `build` with the merged profile.
+# LLVM_BUILD must be set, and contain llvm-profdata.
+set -e
+: "${LLVM_BUILD:?Set LLVM_BUILD to the LLVM build folder}"
+STAGE1=build-pgo
+PROFILE=$PWD/$STAGE1/converter.profdata
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cmake -S . -B $STAGE1 -G Ninja -DCMAKE_BUILD_TYPE=Release -DSTATIC_LTO=ON \
+	-DPGO=GENERATE
+cmake --build $STAGE1 --target converter
+
+# The converter changes the files in place, so it is trained on copies
+copy_corpus() {
+	rm -rf "$WORK/corpus"
+	mkdir "$WORK/corpus"
+	cp input_file.orig.cpp pgo_corpus/*.cpp example_project/*.cpp \
+		example_project/*.h "$WORK/corpus"
+}
+
+export LLVM_PROFILE_FILE="$WORK/profiles/%p.profraw"
+copy_corpus
+for file in "$WORK"/corpus/*.cpp; do
+	$STAGE1/bin/converter "$file" -- -std=c++17 > /dev/null
+done
+copy_corpus
+$STAGE1/bin/converter -j 4 --light_parse "$WORK"/corpus/*.cpp -- -std=c++17 \
+	> /dev/null
+
+"$LLVM_BUILD/bin/llvm-profdata" merge -o "$PROFILE" "$WORK/profiles"
+
+cmake -S . -B build -G Ninja -DCMAKE_BUILD_TYPE=Release -DSTATIC_LTO=ON \
+	-DPGO=USE -DPGO_PROFILE="$PROFILE"
+cmake --build build --target converter
@@ -0,0 +1,37 @@
+// Training input for pgo.sh: C-style arrays in the places the tool converts
+// them, next to code it must leave alone
+#include <cstddef>
+
+static int table[16];
+static const char *const names[3] = {"a", "b", "c"};
+static double matrix[4][4];
+
+namespace geometry {
+struct Polygon {
+	float xs[8] = {};
+	float ys[8] = {};
+	int count;
+	void scale(float factors[2]);
+	void transform(const float m[3][3]);
+};
+
+void Polygon::scale(float factors[2]) {
+	for (int i = 0; i < count; ++i) {
+		xs[i] *= factors[0];
+		ys[i] *= factors[1];
+	}
+}
+} // namespace geometry
+
+template <typename T, std::size_t N> std::size_t length(T (&)[N]) {
+	return N;
+}
+
+int sum(const int values[], int count) {
+	int local[4] = {1, 2, 3, 4};
+	int result = local[0];
+	for (int i = 0; i < count; ++i) {
+		result += values[i];
+	}
+	return result + static_cast<int>(length(table));
+}
@@ -0,0 +1,105 @@
+// Standalone applier of change logs, see change_log.h.
+//
+// Memory maps the logs, groups their changes by file, and applies each file
+// with applyAtomicChanges on a thread pool, like the tools do. Changes found
+// in several logs, e.g. to a header several shards included, are applied
+// once. Nothing is written if any file fails.
+#include "change_log.h"
+#include "../tool_support/tool_support.h"
+
+#include "clang/Basic/SourceManager.h"
+#include "clang/Format/Format.h"
+#include "clang/Tooling/Refactoring/AtomicChange.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+using namespace clang;
+
+static llvm::cl::OptionCategory MyToolCategory("apply_changes options");
+static llvm::cl::list<std::string> Logs(llvm::cl::Positional,
+										llvm::cl::desc("<change logs>"),
+										llvm::cl::OneOrMore,
+										llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> Inplace(
+	"in_place",
+	llvm::cl::desc("Inplace edit the changed files. If not specified the new "
+				   "code is printed to cout."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<unsigned>
+	Jobs("j",
+		 llvm::cl::desc("Number of files to apply in parallel. 0 uses all "
+						"available cores."),
+		 llvm::cl::init(0), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> Cleanup(
+	"cleanup",
+	llvm::cl::desc("Clean up around the changes, like enum_to_string. The "
+				   "array converter does not."),
+	llvm::cl::init(true), llvm::cl::cat(MyToolCategory));
+
+int main(int argc, const char **argv) {
+	llvm::cl::HideUnrelatedOptions(MyToolCategory);
+	llvm::cl::ParseCommandLineOptions(argc, argv,
+									  "Apply the changes of change logs\n");
+
+	auto Opened = change_log::ChangeLogSet::open(Logs);
+	if (!Opened) {
+		llvm::errs() << llvm::toString(Opened.takeError()) << "\n";
+		return 1;
+	}
+	size_t Files = Opened->files();
+
+	tooling::ApplyChangesSpec Spec;
+	Spec.Style = format::getLLVMStyle();
+	Spec.Cleanup = Cleanup;
+
+	std::vector<std::string> NewCode(Files);
+	std::vector<std::string> Errors(Files);
+	std::vector<char> Unchanged(Files, false);
+	llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+	for (size_t I = 0; I < Files; ++I) {
+		Pool.async([&, I] {
+			auto File = Opened->getFilePath(I);
+			auto Code = llvm::MemoryBuffer::getFile(File);
+			if (!Code) {
+				Errors[I] = "Could not read " + File.str() + ": " +
+							Code.getError().message();
+				return;
+			}
+			tooling::AtomicChanges Changes;
+			if (auto Err =
+					Opened->appendChanges(I, (*Code)->getBuffer(), Changes)) {
+				Errors[I] = llvm::toString(std::move(Err));
+				return;
+			}
+
+			auto new_code =
+				applyAtomicChanges(File, (*Code)->getBuffer(), Changes, Spec);
+			if (!new_code) {
+				Errors[I] = llvm::toString(new_code.takeError());
+				return;
+			}
+			Unchanged[I] = new_code.get() == (*Code)->getBuffer();
+			NewCode[I] = std::move(new_code.get());
+		});
+	}
+	Pool.wait();
+	if (tool_support::printErrors(Errors)) {
+		return 1;
+	}
+
+	if (!Inplace) {
+		for (const auto &Code : NewCode) {
+			llvm::outs() << Code;
+		}
+		return 0;
+	}
+
+	std::vector<std::pair<StringRef, StringRef>> Writes;
+	for (size_t I = 0; I < Files; ++I) {
+		if (!Unchanged[I]) {
+			Writes.emplace_back(Opened->getFilePath(I), NewCode[I]);
+		}
+	}
+	return tool_support::writeFiles(Pool, Writes) ? 0 : 1;
+}
@@ -0,0 +1,363 @@
+// Compact binary log of tooling::AtomicChanges.
+//
+// Written by the tools instead of YAML (see --shard_output), and applied by
+// apply_changes or the --merge of the tools. All fields are little-endian
+// 32-bit words, so a log is read in place from a memory mapped file:
+//
+//   Header:       'CLOG', version, string count, file count
+//   Strings:      string count x {offset in the string data, size}
+//   Files:        file count x {path string, change count, offset of the
+//                 first change}
+//   Changes:      per file, change count x
+//                   {key string, inserted header count, removed header
+//                    count, replacement count,
+//                    inserted header strings..., removed header strings...,
+//                    replacement count x {offset, length, text string}}
+//   String data:  the bytes of all strings, padded with zeros to a whole
+//                 number of words
+//
+// Every string, e.g. a path, key or header, is stored once and referred to
+// by its index. Replacements are stored as offsets in their file, and only
+// turned into AtomicChanges once the file is read, see appendChanges.
+#ifndef CHANGE_LOG_CHANGE_LOG_H
+#define CHANGE_LOG_CHANGE_LOG_H
+
+#include "clang/Basic/SourceManager.h"
+#include "clang/Tooling/Refactoring/AtomicChange.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace change_log {
+
+constexpr uint32_t Magic = 0x474f4c43; // "CLOG"
+constexpr uint32_t Version = 1;
+
+/// Collects AtomicChanges and writes them as a change log
+class ChangeLogWriter {
+  public:
+	void add(const clang::tooling::AtomicChange &Change) {
+		auto &FileChanges = Files[intern(Change.getFilePath())];
+		auto &Record = FileChanges.emplace_back();
+		Record.push_back(intern(Change.getKey()));
+		Record.push_back(Change.getInsertedHeaders().size());
+		Record.push_back(Change.getRemovedHeaders().size());
+		Record.push_back(Change.getReplacements().size());
+		for (const auto &Header : Change.getInsertedHeaders()) {
+			Record.push_back(intern(Header));
+		}
+		for (const auto &Header : Change.getRemovedHeaders()) {
+			Record.push_back(intern(Header));
+		}
+		for (const auto &R : Change.getReplacements()) {
+			Record.push_back(R.getOffset());
+			Record.push_back(R.getLength());
+			Record.push_back(intern(R.getReplacementText()));
+		}
+	}
+
+	void write(llvm::raw_ostream &OS) const {
+		auto Word = [&](uint32_t Value) {
+			char Bytes[4];
+			llvm::support::endian::write32le(Bytes, Value);
+			OS.write(Bytes, 4);
+		};
+
+		size_t ChangeWords = 0;
+		for (const auto &[Path, FileChanges] : Files) {
+			for (const auto &Record : FileChanges) {
+				ChangeWords += Record.size();
+			}
+		}
+
+		Word(Magic);
+		Word(Version);
+		Word(Strings.size());
+		Word(Files.size());
+		uint32_t Offset = 0;
+		for (auto String : Strings) {
+			Word(Offset);
+			Word(String.size());
+			Offset += String.size();
+		}
+		// The changes start after the header, strings and files
+		uint32_t Change = 4 * (4 + 2 * Strings.size() + 3 * Files.size());
+		for (const auto &[Path, FileChanges] : Files) {
+			Word(Path);
+			Word(FileChanges.size());
+			Word(Change);
+			for (const auto &Record : FileChanges) {
+				Change += 4 * Record.size();
+			}
+		}
+		for (const auto &[Path, FileChanges] : Files) {
+			for (const auto &Record : FileChanges) {
+				for (auto Value : Record) {
+					Word(Value);
+				}
+			}
+		}
+		size_t Size = 0;
+		for (auto String : Strings) {
+			OS << String;
+			Size += String.size();
+		}
+		OS.write_zeros((4 - Size % 4) % 4);
+	}
+
+  private:
+	uint32_t intern(llvm::StringRef String) {
+		auto [It, Inserted] = StringIds.try_emplace(String, Strings.size());
+		if (Inserted) {
+			// The keys of a StringMap never move
+			Strings.push_back(It->getKey());
+		}
+		return It->second;
+	}
+
+	llvm::StringMap<uint32_t> StringIds;
+	std::vector<llvm::StringRef> Strings;
+	/// The words of each change, by the string of their file
+	std::map<uint32_t, std::vector<std::vector<uint32_t>>> Files;
+};
+
+/// A change log read in place. The buffer is memory mapped if it is large
+/// enough, so opening a log does not read it.
+class ChangeLog {
+  public:
+	static llvm::Expected<ChangeLog> open(llvm::StringRef File) {
+		auto Buffer = llvm::MemoryBuffer::getFile(
+			File, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+		if (!Buffer) {
+			return llvm::createFileError(File, Buffer.getError());
+		}
+		ChangeLog Log(std::move(*Buffer));
+		if (!Log.valid()) {
+			return llvm::createFileError(
+				File, llvm::createStringError(llvm::inconvertibleErrorCode(),
+											  "not a change log"));
+		}
+		return std::move(Log);
+	}
+
+	size_t files() const { return word(3); }
+
+	llvm::StringRef getFilePath(size_t File) const {
+		return string(word(fileWord(File)));
+	}
+
+	/// Append the changes of File to Out, as changes of Code, which must be
+	/// the current contents of the file. Changes whose contents are in Seen
+	/// are skipped, and the others are added to it.
+	/// \returns an error if a change does not fit in Code
+	llvm::Error appendChanges(size_t File, const clang::SourceManager &SM,
+							  clang::tooling::AtomicChanges &Out,
+							  llvm::StringSet<> &Seen) const {
+		auto Path = getFilePath(File);
+		auto Start = SM.getLocForStartOfFile(SM.getMainFileID());
+		auto Size = SM.getBufferData(SM.getMainFileID()).size();
+
+		size_t Change = word(fileWord(File) + 2) / 4;
+		for (size_t I = 0, E = word(fileWord(File) + 1); I < E; ++I) {
+			size_t Inserted = word(Change + 1), Removed = word(Change + 2);
+			size_t Replacements = word(Change + 3);
+			size_t End = Change + 4 + Inserted + Removed + 3 * Replacements;
+			auto First = Change;
+			Change = End;
+			// Identical records from one log have identical strings, and
+			// changes of different files never compare equal
+			if (!Seen.insert(contents(Path, First, End)).second) {
+				continue;
+			}
+
+			clang::tooling::AtomicChange Result(Path, string(word(First)));
+			size_t W = First + 4;
+			for (size_t H = 0; H < Inserted; ++H) {
+				Result.addHeader(string(word(W++)));
+			}
+			for (size_t H = 0; H < Removed; ++H) {
+				Result.removeHeader(string(word(W++)));
+			}
+			for (size_t R = 0; R < Replacements; ++R, W += 3) {
+				size_t Offset = word(W), Length = word(W + 1);
+				if (Offset + Length > Size) {
+					return llvm::createStringError(
+						llvm::inconvertibleErrorCode(),
+						"change beyond the end of " + Path);
+				}
+				auto Loc = Start.getLocWithOffset(Offset);
+				if (auto Err =
+						Result.replace(SM, Loc, Length, string(word(W + 2)))) {
+					return Err;
+				}
+			}
+			Out.push_back(std::move(Result));
+		}
+		return llvm::Error::success();
+	}
+
+  private:
+	explicit ChangeLog(std::unique_ptr<llvm::MemoryBuffer> Buffer)
+		: Buffer(std::move(Buffer)), Data(this->Buffer->getBuffer()) {}
+
+	uint32_t word(size_t Index) const {
+		return llvm::support::endian::read32le(Data.data() + 4 * Index);
+	}
+
+	size_t fileWord(size_t File) const { return 4 + 2 * word(2) + 3 * File; }
+
+	llvm::StringRef string(uint32_t Id) const {
+		return StringData.substr(word(4 + 2 * Id), word(5 + 2 * Id));
+	}
+
+	/// The change in words [First, End) of File with its strings resolved
+	std::string contents(llvm::StringRef Path, size_t First,
+						 size_t End) const {
+		std::string Contents = Path.str();
+		Contents += '\0';
+		Contents += string(word(First));
+		for (size_t W = First + 1; W < First + 4; ++W) {
+			Contents += '\0' + std::to_string(word(W));
+		}
+		size_t Strings = word(First + 1) + word(First + 2);
+		for (size_t W = First + 4; W < End; ++W) {
+			bool IsString =
+				W < First + 4 + Strings || (W - First - 4 - Strings) % 3 == 2;
+			Contents += '\0';
+			Contents += IsString ? string(word(W)).str()
+								 : std::to_string(word(W));
+		}
+		return Contents;
+	}
+
+	/// Check every offset once, so the accessors need not
+	bool valid() {
+		if (Data.size() % 4 || Data.size() < 16 || word(0) != Magic ||
+			word(1) != Version) {
+			return false;
+		}
+		size_t Words = Data.size() / 4;
+		size_t Strings = word(2), Files = word(3);
+		size_t Header = 4 + 2 * Strings + 3 * Files;
+		if (Header > Words) {
+			return false;
+		}
+
+		// The string data follows the last change
+		size_t ChangesEnd = Header;
+		for (size_t F = 0; F < Files; ++F) {
+			if (word(fileWord(F)) >= Strings ||
+				word(fileWord(F) + 2) != 4 * ChangesEnd) {
+				return false;
+			}
+			for (size_t I = 0, E = word(fileWord(F) + 1); I < E; ++I) {
+				if (ChangesEnd + 4 > Words) {
+					return false;
+				}
+				size_t Inserted = word(ChangesEnd + 1);
+				size_t Removed = word(ChangesEnd + 2);
+				size_t Replacements = word(ChangesEnd + 3);
+				size_t End =
+					ChangesEnd + 4 + Inserted + Removed + 3 * Replacements;
+				if (End > Words || word(ChangesEnd) >= Strings) {
+					return false;
+				}
+				for (size_t W = ChangesEnd + 4; W < End; ++W) {
+					bool IsString =
+						W < ChangesEnd + 4 + Inserted + Removed ||
+						(W - ChangesEnd - 4 - Inserted - Removed) % 3 == 2;
+					if (IsString && word(W) >= Strings) {
+						return false;
+					}
+				}
+				ChangesEnd = End;
+			}
+		}
+
+		StringData = Data.drop_front(4 * ChangesEnd);
+		for (size_t S = 0; S < Strings; ++S) {
+			if (uint64_t(word(4 + 2 * S)) + word(5 + 2 * S) >
+				StringData.size()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> Buffer;
+	llvm::StringRef Data;
+	llvm::StringRef StringData;
+};
+
+/// The logs of several shards, with the changes of each file grouped over
+/// all of them
+class ChangeLogSet {
+  public:
+	/// Open each of Files, see ChangeLog::open
+	static llvm::Expected<ChangeLogSet>
+	open(llvm::ArrayRef<std::string> Files) {
+		ChangeLogSet Set;
+		// The sections of each changed file, in the order of the logs
+		std::map<std::string, std::vector<std::pair<size_t, size_t>>> Sections;
+		for (const auto &File : Files) {
+			auto Log = ChangeLog::open(File);
+			if (!Log) {
+				return Log.takeError();
+			}
+			for (size_t F = 0; F < Log->files(); ++F) {
+				Sections[Log->getFilePath(F).str()].emplace_back(
+					Set.Logs.size(), F);
+			}
+			Set.Names.push_back(File);
+			Set.Logs.push_back(std::move(*Log));
+		}
+		Set.Files.assign(std::make_move_iterator(Sections.begin()),
+						 std::make_move_iterator(Sections.end()));
+		return std::move(Set);
+	}
+
+	/// The number of changed files, sorted by path
+	size_t files() const { return Files.size(); }
+
+	llvm::StringRef getFilePath(size_t File) const {
+		return Files[File].first;
+	}
+
+	/// Append the changes of File in all logs to Out, as changes of Code,
+	/// which must be the current contents of the file. Identical changes, e.g.
+	/// to a header included by the files of several shards, are only
+	/// appended once.
+	/// \returns an error naming the log if a change does not fit in Code
+	llvm::Error appendChanges(size_t File, llvm::StringRef Code,
+							  clang::tooling::AtomicChanges &Out) const {
+		const auto &[Path, Sections] = Files[File];
+		clang::SourceManagerForFile Sources(Path, Code);
+		llvm::StringSet<> Seen;
+		for (auto [L, F] : Sections) {
+			if (auto Err = Logs[L].appendChanges(F, Sources.get(), Out, Seen)) {
+				return llvm::createFileError(Names[L], std::move(Err));
+			}
+		}
+		return llvm::Error::success();
+	}
+
+  private:
+	std::vector<std::string> Names;
+	std::vector<ChangeLog> Logs;
+	/// Each changed file, and its sections as {log, file in the log}
+	std::vector<
+		std::pair<std::string, std::vector<std::pair<size_t, size_t>>>>
+		Files;
+};
+
+} // namespace change_log
+
+#endif
@@ -0,0 +1,142 @@
+// Writes change logs and reads them back. Run by ctest, exits with 1 if a
+// change does not survive the round trip.
+#include "change_log.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+
+using namespace clang;
+using namespace clang::tooling;
+
+static int Failures = 0;
+
+static void check(bool Condition, const llvm::Twine &What) {
+	if (!Condition) {
+		llvm::errs() << "FAILED: " << What << "\n";
+		++Failures;
+	}
+}
+
+/// Write Changes of Path to a log, read them back as changes of Code and
+/// compare the result
+static void roundTrip(llvm::StringRef Name, llvm::StringRef Path,
+					  llvm::StringRef Code, const AtomicChanges &Changes) {
+	llvm::SmallString<128> LogPath;
+	if (auto EC = llvm::sys::fs::createTemporaryFile("change_log_test",
+													 "clog", LogPath)) {
+		check(false, Name + ": " + EC.message());
+		return;
+	}
+	llvm::FileRemover Remover(LogPath);
+
+	change_log::ChangeLogWriter Writer;
+	for (const auto &Change : Changes) {
+		Writer.add(Change);
+	}
+	{
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(LogPath, EC);
+		check(!EC, Name + ": cannot write the log");
+		Writer.write(OS);
+	}
+
+	auto Log = change_log::ChangeLog::open(LogPath);
+	if (!Log) {
+		check(false, Name + ": " + llvm::toString(Log.takeError()));
+		return;
+	}
+	check(Log->files() == 1, Name + ": file count");
+	check(Log->getFilePath(0) == Path, Name + ": file path");
+
+	SourceManagerForFile File(Path, Code);
+	AtomicChanges Read;
+	llvm::StringSet<> Seen;
+	if (auto Err = Log->appendChanges(0, File.get(), Read, Seen)) {
+		check(false, Name + ": " + llvm::toString(std::move(Err)));
+		return;
+	}
+	check(Read.size() == Changes.size(), Name + ": change count");
+	for (size_t I = 0; I < Read.size() && I < Changes.size(); ++I) {
+		check(Read[I].toYAMLString() == Changes[I].toYAMLString(),
+			  Name + ": change " + std::to_string(I));
+	}
+}
+
+/// Write the same changes of Path to two logs, and check that the set of
+/// both only has them once
+static void mergeTwice(llvm::StringRef Path, llvm::StringRef Code,
+					   const AtomicChanges &Changes) {
+	std::vector<std::string> LogPaths;
+	llvm::FileRemover Removers[2];
+	for (int L = 0; L < 2; ++L) {
+		llvm::SmallString<128> LogPath;
+		if (auto EC = llvm::sys::fs::createTemporaryFile("change_log_test",
+														 "clog", LogPath)) {
+			check(false, "merge: " + EC.message());
+			return;
+		}
+		Removers[L].setFile(LogPath);
+		LogPaths.push_back(LogPath.str().str());
+
+		change_log::ChangeLogWriter Writer;
+		for (const auto &Change : Changes) {
+			Writer.add(Change);
+		}
+		std::error_code EC;
+		llvm::raw_fd_ostream OS(LogPath, EC);
+		check(!EC, "merge: cannot write the log");
+		Writer.write(OS);
+	}
+
+	auto Set = change_log::ChangeLogSet::open(LogPaths);
+	if (!Set) {
+		check(false, "merge: " + llvm::toString(Set.takeError()));
+		return;
+	}
+	check(Set->files() == 1, "merge: file count");
+	check(Set->getFilePath(0) == Path, "merge: file path");
+	AtomicChanges Read;
+	if (auto Err = Set->appendChanges(0, Code, Read)) {
+		check(false, "merge: " + llvm::toString(std::move(Err)));
+		return;
+	}
+	check(Read.size() == Changes.size(), "merge: change count");
+}
+
+/// One change of Path with a replacement of each text at the start of Code
+static AtomicChange makeChange(SourceManagerForFile &File, llvm::StringRef Key,
+							   llvm::ArrayRef<llvm::StringRef> Texts) {
+	auto &SM = File.get();
+	auto Start = SM.getLocForStartOfFile(SM.getMainFileID());
+	AtomicChange Change(SM.getFilename(Start), Key);
+	unsigned Offset = 0;
+	for (auto Text : Texts) {
+		if (auto Err = Change.replace(SM, Start.getLocWithOffset(Offset), 1,
+									  Text)) {
+			check(false, llvm::toString(std::move(Err)));
+		}
+		Offset += 2;
+	}
+	return Change;
+}
+
+int main() {
+	llvm::StringRef Path = "input.cpp", Code = "a b c d e f\n";
+	SourceManagerForFile File(Path, Code);
+
+	// The string data holds "input.cpp", the key and the texts. Cover every
+	// remainder of its size modulo 4, since the strings end the log.
+	for (llvm::StringRef Key : {"k", "k1", "k12", "k123"}) {
+		AtomicChanges Changes;
+		Changes.push_back(makeChange(File, Key, {"x", "yy", "zzz"}));
+		auto Header = makeChange(File, "header", {"w"});
+		Header.addHeader("vector");
+		Changes.push_back(std::move(Header));
+		roundTrip("key " + Key.str(), Path, Code, Changes);
+		if (Key == "k") {
+			mergeTwice(Path, Code, Changes);
+		}
+	}
+
+	return Failures ? 1 : 0;
+}
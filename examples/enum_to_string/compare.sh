@@ -0,0 +1,20 @@
+#!/bin/bash
+# Compares the single-step tool with the multi-step tool on
+# input_file.orig.cpp. Both tools must be built in their `build` folders.
+# Fails if the single-step tool is the slowest.
+RUNS=${1:-100}
+SINGLE_STEP=./build/bin/enum_to_string
+MULTI_STEP=../enum_to_string_multi_step/build/bin/enum_to_string
+
+cp input_file.orig.cpp input_file.cpp
+
+bench() {
+	local start=$(date +%s%N)
+	for i in $(seq $RUNS); do $1 input_file.cpp -- > /dev/null; done
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+single=$(bench $SINGLE_STEP)
+multi=$(bench $MULTI_STEP)
+echo "Single-step: ${single}ms, multi-step: ${multi}ms ($RUNS runs)"
+[ "$single" -le "$multi" ]
@@ -1,7 +1,14 @@
+#include "../change_log/change_log.h"
+#include "../token_prefilter/token_prefilter.h"
+#include "../tool_support/tool_support.h"
+#include "socket_path.h"
+
 // Declares clang::SyntaxOnlyAction.
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/ASTMatchers/ASTMatchersMacros.h"
-#include "clang/Frontend/TextDiagnosticPrinter.h"
-#include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Refactoring.h"
 #include "clang/Tooling/Transformer/RewriteRule.h"
@@ -9,9 +16,41 @@
 #include "clang/Tooling/Transformer/Stencil.h"
 #include "clang/Tooling/Transformer/Transformer.h"
 // Declares llvm::cl::extrahelp.
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <optional>
 #include <sstream>
 #include <type_traits>
@@ -34,107 +73,491 @@ static llvm::cl::OptionCategory MyToolCategory(
 static llvm::cl::opt<bool> Inplace(
 	"in_place",
 	llvm::cl::desc("Inplace edit <file>s, if specified. If not specified the "
-				   "generated code will be printed to cout."),
+				   "generated code will be printed to cout. See --output."),
 	llvm::cl::cat(MyToolCategory));
+/// What to print when the <file>s are not edited in place
+enum class OutputFormat { Code, Diff, YAML };
+static llvm::cl::opt<OutputFormat> Output(
+	"output",
+	llvm::cl::desc("What to print when not editing in place. See --in_place."),
+	llvm::cl::values(
+		clEnumValN(OutputFormat::Code, "code",
+				   "The new code of each changed file (default)"),
+		clEnumValN(OutputFormat::Diff, "diff",
+				   "A unified diff of each changed file"),
+		clEnumValN(OutputFormat::YAML, "yaml",
+				   "The changes as YAML, without applying them")),
+	llvm::cl::init(OutputFormat::Code), llvm::cl::cat(MyToolCategory));
 static llvm::cl::opt<bool>
 	DebugMsgs("debug_info", llvm::cl::desc("Print debug information to cout."),
 			  llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<unsigned>
+	Jobs("j",
+		 llvm::cl::desc("Number of translation units to process in parallel. "
+						"0 uses all available cores. The threads take the "
+						"translation units in order from one shared queue, "
+						"without work stealing."),
+		 llvm::cl::init(1), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> PCHCache(
+	"pch_cache",
+	llvm::cl::desc("Directory for precompiled preambles. The #includes at the "
+				   "top of each file are precompiled once per unique set of "
+				   "includes and compile flags, and reused by other files and "
+				   "later runs. Disabled if not specified."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ResultCacheDir(
+	"result_cache",
+	llvm::cl::desc("Directory for the changes generated for each file. Files "
+				   "whose contents, includes and compile command are unchanged "
+				   "since a previous run with the same rules and options "
+				   "reuse its changes instead of being parsed. Disabled if not "
+				   "specified."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> LightParse(
+	"light_parse",
+	llvm::cl::desc("Skip the function bodies outside of <file>s, and with them "
+				   "most template instantiations. The rules only look at "
+				   "declarations in <file>s, so the output is the same."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> TraceFile(
+	"trace",
+	llvm::cl::desc("Write a Chrome trace of the run to <file.json>, with the "
+				   "frontend's own scopes next to the parsing, matching, "
+				   "stencils and writing of the tool. Open it in "
+				   "chrome://tracing or ui.perfetto.dev."),
+	llvm::cl::value_desc("file.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ProfileMatchers(
+	"profile_matchers",
+	llvm::cl::desc("Profile the matchers of each rule. When done, prints the "
+				   "time spent and the number of matches per rule, and writes "
+				   "them to <file.json>."),
+	llvm::cl::value_desc("file.json"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> ToStringTable(
+	"to_string_table",
+	llvm::cl::desc("Generate to_string as a lookup in a table of the names "
+				   "instead of a switch. See --table_density."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<double> TableDensity(
+	"table_density",
+	llvm::cl::desc("With --to_string_table, enums using at least this fraction "
+				   "of the values between their smallest and largest "
+				   "enumerator get a table indexed by the value. Sparser enums "
+				   "get a sorted table searched with binary search. Between 0 "
+				   "and 1."),
+	llvm::cl::init(0.5), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> FromString(
+	"from_string",
+	llvm::cl::desc("Also generate from_string<Enum>(std::string_view), giving "
+				   "the enumerator with that name as a std::optional<Enum>. "
+				   "Looks the name up with a perfect hash."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> OutOfLine(
+	"out_of_line",
+	llvm::cl::desc("Only declare the generated functions next to the enums, "
+				   "and define them in a generated source file per <file>: "
+				   "<file> with the extension .to_string.cpp. Regenerating "
+				   "then only changes the generated files. The <file>s must "
+				   "be headers, as the generated files include them."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> Shard(
+	"shard",
+	llvm::cl::desc("Only process the <file>s of shard i out of N, e.g. 0/4, to "
+				   "spread a run over several processes or machines. Files "
+				   "are assigned to shards by a hash of their path. Requires "
+				   "--shard_output."),
+	llvm::cl::value_desc("i/N"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> ShardOutput(
+	"shard_output",
+	llvm::cl::desc("Write the changes to <file> as a change log instead of "
+				   "applying them. The changes of all shards are applied with "
+				   "--merge or apply_changes."),
+	llvm::cl::value_desc("file"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::list<std::string> MergeFiles(
+	"merge",
+	llvm::cl::desc("Apply the changes written by the --shard_output of all "
+				   "shards, as with --in_place or --output. Changes to headers "
+				   "found by several shards are applied once. Takes no "
+				   "<file>s."),
+	llvm::cl::value_desc("files"), llvm::cl::CommaSeparated,
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<std::string> DefinitionsFile(
+	"definitions_file",
+	llvm::cl::desc("With --out_of_line, define the generated functions of all "
+				   "<file>s in this one source file instead, e.g. one per "
+				   "target."),
+	llvm::cl::value_desc("file.cpp"), llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> Streaming(
+	"streaming",
+	llvm::cl::desc("Parse every <file> with its own file manager, and release "
+				   "its AST and memory right after matching, even with -j 1. "
+				   "Reports the peak resident memory and the allocations of "
+				   "the files that used the most memory. The peak resident "
+				   "memory of a file is only its own with -j 1."),
+	llvm::cl::cat(MyToolCategory));
+// The prefilter only reads the bytes of the main file. It does not expand
+// macros, so a file that declares its enums through `#define ENUM enum` from
+// a header, or through a macro like `DECLARE_ENUM(Color, Red)`, is skipped.
+static llvm::cl::opt<bool> Prefilter(
+	"prefilter",
+	llvm::cl::desc("Skip the <file>s that do not contain a token every rule "
+				   "needs, e.g. enum, outside of comments and literals, "
+				   "without parsing them. Misses the matches that only come "
+				   "from macros defined in other files, e.g. #define ENUM "
+				   "enum in a header."),
+	llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<unsigned> MaxBufferedChanges(
+	"max_buffered_changes",
+	llvm::cl::desc("Spill the changes to a temporary change log whenever more "
+				   "than this many are buffered in memory, and only read them "
+				   "back to apply them. 0 never spills."),
+	llvm::cl::init(0), llvm::cl::cat(MyToolCategory));
 
-struct EnumStringGeneratorTool : public tooling::ClangTool {
-	EnumStringGeneratorTool(
-		const tooling::CompilationDatabase &Compilations,
-		ArrayRef<std::string> SourcePaths,
-		std::shared_ptr<PCHContainerOperations> PCHContainerOps =
-			std::make_shared<PCHContainerOperations>())
-		: ClangTool(Compilations, SourcePaths, std::move(PCHContainerOps)) {}
+/// Allocations through operator new by the current thread, and their bytes.
+/// A translation unit is parsed on one thread, so these tell its allocations
+/// apart from those of the others with -j. Only counted with --streaming, see
+/// MemoryReport.
+static std::atomic<bool> CountAllocations{false};
+static thread_local uint64_t ThreadAllocations = 0;
+static thread_local uint64_t ThreadAllocatedBytes = 0;
 
-	/// Return a reference to the current changes
-	tooling::AtomicChanges &getChanges() { return Changes; }
+static void countAllocation(size_t Size) {
+	if (CountAllocations.load(std::memory_order_relaxed)) {
+		++ThreadAllocations;
+		ThreadAllocatedBytes += Size;
+	}
+}
 
-	/// Call run(), apply all generated replacements, and immediately save
-	/// the results to disk.
-	///
-	/// \returns 0 upon success. Non-zero upon failure.
-	int runAndSave(tooling::FrontendActionFactory *ActionFactory) {
-		if (int Result = run(ActionFactory)) {
-			return Result;
-		}
+// The array, nothrow and sized forms of the standard library forward to
+// these. llvm::allocate_buffer, e.g. of BumpPtrAllocator, uses the aligned
+// forms for over-aligned memory.
+void *operator new(size_t Size) {
+	countAllocation(Size);
+	if (void *Ptr = std::malloc(Size ? Size : 1)) {
+		return Ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void *operator new(size_t Size, std::align_val_t Alignment) {
+	countAllocation(Size);
+	auto Align = static_cast<size_t>(Alignment);
+	// aligned_alloc needs a multiple of the alignment
+	Size = (std::max<size_t>(Size, 1) + Align - 1) / Align * Align;
+	if (void *Ptr = std::aligned_alloc(Align, Size)) {
+		return Ptr;
+	}
+	throw std::bad_alloc();
+}
 
-		LangOptions DefaultLangOptions;
-		IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts =
-			new DiagnosticOptions();
-		TextDiagnosticPrinter DiagnosticPrinter(llvm::errs(), &*DiagOpts);
-		DiagnosticsEngine Diagnostics(
-			IntrusiveRefCntPtr<DiagnosticIDs>(new DiagnosticIDs()), &*DiagOpts,
-			&DiagnosticPrinter, false);
+void operator delete(void *Ptr) noexcept { std::free(Ptr); }
+void operator delete(void *Ptr, size_t) noexcept { std::free(Ptr); }
+void operator delete(void *Ptr, std::align_val_t) noexcept { std::free(Ptr); }
+void operator delete(void *Ptr, size_t, std::align_val_t) noexcept {
+	std::free(Ptr);
+}
 
-		SourceManager Sources(Diagnostics, getFiles());
-		Rewriter Rewrite(Sources, DefaultLangOptions);
+/// Lines [OldStart, OldEnd) of the old text replaced by the lines
+/// [NewStart, NewEnd) of the new text
+struct DiffRegion {
+	size_t OldStart, OldEnd, NewStart, NewEnd;
+};
 
-		return applyAllChanges(Rewrite);
+/// Split Text into lines, keeping their line breaks
+static std::vector<StringRef> splitLines(StringRef Text) {
+	std::vector<StringRef> Lines;
+	while (!Text.empty()) {
+		auto End = Text.find('\n');
+		End = End == StringRef::npos ? Text.size() : End + 1;
+		Lines.push_back(Text.take_front(End));
+		Text = Text.drop_front(End);
 	}
+	return Lines;
+}
 
-	/// @brief Apply all the saved changes to the rewriter
-	/// @param Rewrite - the rewriter to use
-	/// @return true if sucessfull
-	bool applyAllChanges(Rewriter &Rewrite) {
-		auto &sm = Rewrite.getSourceMgr();
-		auto &fm = sm.getFileManager();
+/// The regions that differ between Old and New, found with Myers' algorithm
+/// in O((N + M) * D) time and O(D^2) memory for D different lines. Beyond
+/// MaxEdits different lines, everything is one region.
+static std::vector<DiffRegion> diffLines(ArrayRef<StringRef> Old,
+										 ArrayRef<StringRef> New,
+										 int64_t MaxEdits = 1000) {
+	int64_t N = Old.size(), M = New.size();
+	int64_t Max = std::min(N + M, MaxEdits);
+	// Furthest x reached on each diagonal k = x - y, offset by Max + 1
+	std::vector<int64_t> V(2 * Max + 3, 0);
+	auto At = [&](std::vector<int64_t> &Diagonals, int64_t K) -> int64_t & {
+		return Diagonals[K + Max + 1];
+	};
+	// V after each step D, for the diagonals -D to D
+	std::vector<std::vector<int64_t>> Trace;
 
-		// FIXME: Add automatic formatting support as well.
-		tooling::ApplyChangesSpec Spec;
-		Spec.Style = format::getLLVMStyle();
+	int64_t Edits = -1;
+	for (int64_t D = 0; D <= Max && Edits < 0; ++D) {
+		for (int64_t K = -D; K <= D; K += 2) {
+			int64_t X = K == -D || (K != D && At(V, K - 1) < At(V, K + 1))
+							? At(V, K + 1)
+							: At(V, K - 1) + 1;
+			int64_t Y = X - K;
+			while (X < N && Y < M && Old[X] == New[Y]) {
+				++X;
+				++Y;
+			}
+			At(V, K) = X;
+			if (X >= N && Y >= M) {
+				Edits = D;
+			}
+		}
+		Trace.emplace_back(V.begin() + Max + 1 - D, V.begin() + Max + 2 + D);
+	}
+	if (Edits < 0) {
+		return {{0, size_t(N), 0, size_t(M)}};
+	}
 
-		// Split the changes according to filename
-		std::map<std::string, tooling::AtomicChanges> Files;
-		for (const auto &Change : Changes)
-			Files[Change.getFilePath()].push_back(Change);
+	// Walk back from the end, one inserted or deleted line per step
+	std::vector<DiffRegion> Regions;
+	int64_t X = N, Y = M;
+	for (int64_t D = Edits; D > 0; --D) {
+		const auto &Prev = Trace[D - 1];
+		auto PrevAt = [&](int64_t K) { return Prev[K + D - 1]; };
+		int64_t K = X - Y;
+		bool Insert = K == -D || (K != D && PrevAt(K - 1) < PrevAt(K + 1));
+		int64_t PrevK = Insert ? K + 1 : K - 1;
+		int64_t PrevX = PrevAt(PrevK), PrevY = PrevX - PrevK;
 
-		// Apply all atomic changes to all files
-		for (const auto &[File, FileChanges] : Files) {
-			// Get File from file manager
-			auto Entry = fm.getFileRef(File);
-			if (!Entry) {
-				llvm::errs() << Entry.takeError();
-				return false;
+		DiffRegion Edit{size_t(PrevX), size_t(PrevX + !Insert), size_t(PrevY),
+						size_t(PrevY + Insert)};
+		// Regions are found from the end, so extend the previous one
+		// backwards
+		if (!Regions.empty() && Regions.back().OldStart == Edit.OldEnd &&
+			Regions.back().NewStart == Edit.NewEnd) {
+			Regions.back().OldStart = Edit.OldStart;
+			Regions.back().NewStart = Edit.NewStart;
+		} else {
+			Regions.push_back(Edit);
+		}
+		X = PrevX;
+		Y = PrevY;
+	}
+	std::reverse(Regions.begin(), Regions.end());
+	return Regions;
+}
+
+/// Print the changes from Old to New of File as a unified diff, with three
+/// lines of context. Old is None for a file that does not exist yet, which
+/// the diff creates. The hunks come from a line diff of the code before and
+/// after applyAtomicChanges rather than from the replacement ranges, as the
+/// cleanup and the inserted headers also change code outside of them. Only
+/// the lines between the first and the last changed line are compared, so
+/// the cost still follows the size of the changes rather than of the file.
+static void printUnifiedDiff(StringRef File, std::optional<StringRef> Old,
+							 StringRef New, llvm::raw_ostream &OS) {
+	constexpr size_t Context = 3;
+	auto OldLines = splitLines(Old.value_or(""));
+	auto NewLines = splitLines(New);
+
+	size_t Prefix = 0;
+	while (Prefix < OldLines.size() && Prefix < NewLines.size() &&
+		   OldLines[Prefix] == NewLines[Prefix]) {
+		++Prefix;
+	}
+	size_t Suffix = 0;
+	while (Suffix < OldLines.size() - Prefix &&
+		   Suffix < NewLines.size() - Prefix &&
+		   OldLines[OldLines.size() - 1 - Suffix] ==
+			   NewLines[NewLines.size() - 1 - Suffix]) {
+		++Suffix;
+	}
+	auto Regions = diffLines(
+		ArrayRef<StringRef>(OldLines).slice(Prefix,
+											OldLines.size() - Prefix - Suffix),
+		ArrayRef<StringRef>(NewLines).slice(Prefix,
+											NewLines.size() - Prefix - Suffix));
+	if (Regions.empty()) {
+		return;
+	}
+	for (auto &Region : Regions) {
+		Region.OldStart += Prefix;
+		Region.OldEnd += Prefix;
+		Region.NewStart += Prefix;
+		Region.NewEnd += Prefix;
+	}
+
+	auto PrintLine = [&](char Kind, StringRef Line) {
+		OS << Kind << Line;
+		if (!Line.endswith("\n")) {
+			OS << "\n\\ No newline at end of file\n";
+		}
+	};
+
+	OS << "--- " << (Old ? File : "/dev/null") << "\n+++ " << File << "\n";
+	for (size_t I = 0; I < Regions.size();) {
+		// Regions closer than twice the context share a hunk
+		size_t J = I;
+		while (J + 1 < Regions.size() &&
+			   Regions[J + 1].OldStart - Regions[J].OldEnd <= 2 * Context) {
+			++J;
+		}
+		size_t PrevEnd = I > 0 ? Regions[I - 1].OldEnd : 0;
+		size_t NextStart =
+			J + 1 < Regions.size() ? Regions[J + 1].OldStart : OldLines.size();
+		size_t Before = std::min(Context, Regions[I].OldStart - PrevEnd);
+		size_t After = std::min(Context, NextStart - Regions[J].OldEnd);
+		size_t OldStart = Regions[I].OldStart - Before;
+		size_t NewStart = Regions[I].NewStart - Before;
+		size_t OldCount = Regions[J].OldEnd + After - OldStart;
+		size_t NewCount = Regions[J].NewEnd + After - NewStart;
+
+		// Empty ranges start at the line before them
+		OS << "@@ -" << (OldCount ? OldStart + 1 : OldStart) << ","
+		   << OldCount << " +" << (NewCount ? NewStart + 1 : NewStart) << ","
+		   << NewCount << " @@\n";
+		size_t Line = OldStart;
+		for (size_t R = I; R <= J; ++R) {
+			for (; Line < Regions[R].OldStart; ++Line) {
+				PrintLine(' ', OldLines[Line]);
+			}
+			for (; Line < Regions[R].OldEnd; ++Line) {
+				PrintLine('-', OldLines[Line]);
+			}
+			for (size_t N = Regions[R].NewStart; N < Regions[R].NewEnd; ++N) {
+				PrintLine('+', NewLines[N]);
 			}
+		}
+		for (; Line < Regions[J].OldEnd + After; ++Line) {
+			PrintLine(' ', OldLines[Line]);
+		}
+		I = J + 1;
+	}
+}
 
-			// Get the id for the file
-			auto id = sm.getOrCreateFileID(Entry.get(), SrcMgr::C_User);
+/// Changes grouped by the file they apply to. Changes are moved into the
+/// bucket of their file as they are produced, and applied from there.
+class ChangeSet {
+  public:
+	/// Number of changes a new bucket holds before it has to grow
+	static constexpr size_t InitialBucketSize = 256;
 
-			// Read the current code and apply all the changes that to that file
-			auto code = sm.getBufferData(id);
-			auto new_code = applyAtomicChanges(File, code, FileChanges, Spec);
+	void add(tooling::AtomicChange &&Change) {
+		auto [It, Inserted] = Files.try_emplace(Change.getFilePath());
+		if (Inserted) {
+			It->second.reserve(InitialBucketSize);
+		}
+		It->second.push_back(std::move(Change));
+		++Size;
+	}
 
-			if (!new_code) {
-				llvm::errs() << new_code.takeError();
-				return false;
+	/// Move all changes of Other behind the changes of the same file
+	void append(ChangeSet &&Other) {
+		for (auto &[File, Changes] : Other.Files) {
+			auto &Bucket = Files[File];
+			if (Bucket.empty()) {
+				Bucket = std::move(Changes);
+			} else {
+				std::move(Changes.begin(), Changes.end(),
+						  std::back_inserter(Bucket));
 			}
+		}
+		Other.Files.clear();
+		Size += Other.Size;
+		Other.Size = 0;
+		for (auto &[File, Definitions] : Other.FileDefinitions) {
+			auto &Bucket = FileDefinitions[File];
+			std::move(Definitions.begin(), Definitions.end(),
+					  std::back_inserter(Bucket));
+		}
+		Other.FileDefinitions.clear();
+	}
 
-			if (!Inplace) {
-				llvm::outs() << new_code.get();
-				continue;
+	/// Add a definition for the generated source file of File, see
+	/// --out_of_line
+	void addDefinition(StringRef File, std::string &&Definition) {
+		FileDefinitions[File.str()].push_back(std::move(Definition));
+	}
+
+	/// The definitions for the generated source file of each file, in the
+	/// order they were added
+	const std::map<std::string, std::vector<std::string>> &definitions() const {
+		return FileDefinitions;
+	}
+
+	/// Number of changes in all buckets
+	size_t size() const { return Size; }
+
+	/// The changes of all buckets, in order of their file names
+	std::vector<const tooling::AtomicChange *> changes() const {
+		std::vector<const tooling::AtomicChange *> All;
+		All.reserve(Size);
+		for (const auto &[File, Changes] : Files) {
+			for (const auto &Change : Changes) {
+				All.push_back(&Change);
 			}
+		}
+		return All;
+	}
+
+	/// Remove the changes, but keep the definitions
+	void clearChanges() {
+		Files.clear();
+		Size = 0;
+	}
 
-			// Replace the entire file with the new code
-			auto fileRange = SourceRange(sm.getLocForStartOfFile(id),
-										 sm.getLocForEndOfFile(id));
-			Rewrite.ReplaceText(fileRange, new_code.get());
+	/// Iterate the buckets in order of their file names
+	auto begin() { return Files.begin(); }
+	auto end() { return Files.end(); }
+	auto begin() const { return Files.begin(); }
+	auto end() const { return Files.end(); }
+
+  private:
+	std::map<std::string, tooling::AtomicChanges> Files;
+	std::map<std::string, std::vector<std::string>> FileDefinitions;
+	size_t Size = 0;
+};
+
+/// The code of the files rewritten by the stages of a pipeline so far, see
+/// runPipeline. Each stage parses the rewritten code instead of the code on
+/// disk, so nothing is written before the last stage succeeded.
+class RewrittenFiles {
+  public:
+	/// The real file system, with the rewritten files over it. Refers to the
+	/// code in this, so it must not be used once a file is set again.
+	IntrusiveRefCntPtr<llvm::vfs::FileSystem> getFileSystem() const {
+		// A new InMemoryFileSystem every time, as it cannot replace a file
+		IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> Memory(
+			new llvm::vfs::InMemoryFileSystem);
+		for (const auto &[File, Code] : Files) {
+			Memory->addFile(File, /*ModificationTime=*/0,
+							llvm::MemoryBuffer::getMemBuffer(
+								Code, File, /*RequiresNullTerminator=*/false));
 		}
+		auto Overlay = llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(
+			llvm::vfs::getRealFileSystem());
+		Overlay->pushOverlay(std::move(Memory));
+		return Overlay;
+	}
 
-		// Apply all changes to disk
-		return Rewrite.overwriteChangedFiles();
+	void set(StringRef File, std::string &&Code) {
+		SmallString<256> Path(File);
+		llvm::sys::fs::make_absolute(Path);
+		llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+		Files[std::string(Path)] = std::move(Code);
 	}
 
+	/// The new code of each rewritten file, by its absolute path
+	const std::map<std::string, std::string> &files() const { return Files; }
+
   private:
-	tooling::AtomicChanges Changes{};
+	std::map<std::string, std::string> Files;
 };
 
 struct MyConsumer {
-	explicit MyConsumer(tooling::AtomicChanges &Changes) : Changes(Changes) {}
+	explicit MyConsumer(ChangeSet &Changes) : Changes(Changes) {}
 
-	auto RefactorConsumer() {
-		return [this](Expected<tooling::TransformerResult<std::string>> C) {
+	/// Consumer for the rule called Rule. If MetadataIsDefinition, the
+	/// metadata is a definition for the generated source file of the file the
+	/// changes are in, or empty.
+	auto RefactorConsumer(StringRef Rule, bool MetadataIsDefinition = false) {
+		return [this, Rule = Rule.str(), MetadataIsDefinition](
+				   Expected<tooling::TransformerResult<std::string>> C) {
+			llvm::TimeTraceScope Scope("Consumer", Rule);
 			if (not C) {
 				throw std::runtime_error(
 					append_file_line("Error generating changes: " +
@@ -145,14 +568,731 @@ struct MyConsumer {
 				llvm::errs() << "Debug: " << C.get().Metadata << "\n";
 			}
 
+			if (MetadataIsDefinition && !C.get().Metadata.empty() &&
+				!C.get().Changes.empty()) {
+				Changes.addDefinition(C.get().Changes.front().getFilePath(),
+									  std::move(C.get().Metadata));
+			}
+
 			// Save the changes to be handled later
-			Changes.insert(Changes.begin(), C.get().Changes.begin(),
-						   C.get().Changes.end());
+			for (auto &Change : C.get().Changes) {
+				Changes.add(std::move(Change));
+			}
+		};
+	}
+
+  private:
+	ChangeSet &Changes;
+};
+
+using RuleType = transformer::RewriteRuleWith<std::string>;
+
+/// A rule and the name it is reported by
+struct NamedRule {
+	std::string Name;
+	RuleType Rule;
+	/// See MyConsumer::RefactorConsumer
+	bool MetadataIsDefinition = false;
+	/// The rule only matches if the main file contains one of these, see
+	/// --prefilter. Empty if it can match without, e.g. in headers.
+	std::vector<std::string> Tokens = {};
+};
+
+/// The resident set size of the process and its peak, in bytes, from
+/// /proc/self/status. Both are 0 where that does not exist.
+static std::pair<uint64_t, uint64_t> readResidentMemory() {
+	uint64_t RSS = 0, Peak = 0;
+	auto Status = llvm::MemoryBuffer::getFileAsStream("/proc/self/status");
+	if (!Status) {
+		return {RSS, Peak};
+	}
+	SmallVector<StringRef, 64> Lines;
+	(*Status)->getBuffer().split(Lines, '\n');
+	for (auto Line : Lines) {
+		auto [Key, Value] = Line.split(':');
+		Value = Value.trim();
+		uint64_t KB;
+		if (!Value.consume_back(" kB") || Value.getAsInteger(10, KB)) {
+			continue;
+		}
+		if (Key == "VmRSS") {
+			RSS = KB * 1024;
+		} else if (Key == "VmHWM") {
+			Peak = KB * 1024;
+		}
+	}
+	return {RSS, Peak};
+}
+
+/// Restart the peak of readResidentMemory at the current resident set size.
+/// The peak is the one of the process, so this also restarts it for the
+/// translation units parsed on other threads.
+static void resetPeakResidentMemory() {
+	std::error_code EC;
+	llvm::raw_fd_ostream ClearRefs("/proc/self/clear_refs", EC);
+	if (!EC) {
+		ClearRefs << "5";
+	}
+}
+
+/// Memory used by each translation unit, and by the buffered changes. See
+/// --streaming.
+class MemoryReport {
+  public:
+	struct Entry {
+		std::string File;
+		/// Peak resident set size of the process since the translation unit
+		/// started. Only meaningful with -j 1: otherwise it includes the
+		/// translation units parsed at the same time, and is restarted when
+		/// they start.
+		uint64_t PeakRSS;
+		/// Allocations through operator new, and their bytes
+		uint64_t Allocations, AllocatedBytes;
+		/// Files seen by the file manager of the translation unit
+		unsigned Files;
+	};
+
+	void add(Entry &&TU) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Entries.push_back(std::move(TU));
+	}
+
+	/// Record the number of changes buffered in memory
+	void buffered(size_t Changes) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		MaxBuffered = std::max(MaxBuffered, Changes);
+	}
+
+	/// Record that Changes changes were spilled to a change log
+	void spilled(size_t Changes) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		++Spills;
+		Spilled += Changes;
+	}
+
+	/// Print the totals, and the Top translation units by peak memory
+	void print(raw_ostream &OS, size_t Top = 10) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		constexpr double MiB = 1024 * 1024;
+		uint64_t Peak = 0, Allocations = 0, Bytes = 0;
+		for (const auto &TU : Entries) {
+			Peak = std::max(Peak, TU.PeakRSS);
+			Allocations += TU.Allocations;
+			Bytes += TU.AllocatedBytes;
+		}
+		OS << llvm::format("Peak resident memory %.1f MiB, %llu allocations "
+						   "of %.1f MiB in %zu translation units\n",
+						   Peak / MiB, (unsigned long long)Allocations,
+						   Bytes / MiB, Entries.size());
+		OS << "Buffered at most " << MaxBuffered << " changes, spilled "
+		   << Spilled << " changes to " << Spills << " change logs\n";
+
+		llvm::sort(Entries, [](const Entry &A, const Entry &B) {
+			if (A.PeakRSS != B.PeakRSS) {
+				return A.PeakRSS > B.PeakRSS;
+			}
+			return A.AllocatedBytes > B.AllocatedBytes;
+		});
+		OS << llvm::format("%10s %12s %12s %7s  %s\n", "Peak (MiB)",
+						   "Allocations", "Alloc (MiB)", "Files",
+						   "Translation unit");
+		for (const auto &TU : ArrayRef<Entry>(Entries).take_front(Top)) {
+			OS << llvm::format("%10.1f %12llu %12.1f %7u  ", TU.PeakRSS / MiB,
+							   (unsigned long long)TU.Allocations,
+							   TU.AllocatedBytes / MiB, TU.Files)
+			   << TU.File << "\n";
+		}
+	}
+
+  private:
+	std::vector<Entry> Entries;
+	size_t MaxBuffered = 0;
+	size_t Spills = 0;
+	size_t Spilled = 0;
+	std::mutex Mutex;
+};
+
+struct EnumStringGeneratorTool : public tooling::ClangTool {
+	EnumStringGeneratorTool(
+		const tooling::CompilationDatabase &Compilations,
+		ArrayRef<std::string> SourcePaths,
+		std::shared_ptr<PCHContainerOperations> PCHContainerOps =
+			std::make_shared<PCHContainerOperations>(),
+		IntrusiveRefCntPtr<FileManager> Files = nullptr,
+		RewrittenFiles *Rewritten = nullptr)
+		: EnumStringGeneratorTool(Compilations, SourcePaths,
+								  std::move(PCHContainerOps), std::move(Files),
+								  Rewritten,
+								  Rewritten ? Rewritten->getFileSystem()
+											: llvm::vfs::getRealFileSystem()) {
+	}
+
+	/// The new code of a file, and the code it replaces
+	struct FileUpdate {
+		std::string File;
+		/// Null for a new file
+		std::unique_ptr<llvm::MemoryBuffer> OldCode;
+		std::string NewCode;
+	};
+
+	/// Return a reference to the current changes
+	ChangeSet &getChanges() { return Changes; }
+
+	/// Append an arguments adjuster. Unlike ClangTool's, the adjuster is also
+	/// used by the tools created for each translation unit by runParallel.
+	void appendArgumentsAdjuster(tooling::ArgumentsAdjuster Adjuster) {
+		Adjusters.push_back(Adjuster);
+		ClangTool::appendArgumentsAdjuster(std::move(Adjuster));
+	}
+
+	/// Reuse the precompiled preambles stored in Dir. See
+	/// tool_support::PreambleCache.
+	void usePreambleCache(StringRef Dir) {
+		Preambles = std::make_unique<tool_support::PreambleCache>(
+			Dir, PCHContainerOps);
+		appendArgumentsAdjuster(Preambles->getAdjuster());
+	}
+
+	/// Only parse the function bodies in the main files. Must be called before
+	/// usePreambleCache, so the preambles skip the bodies too.
+	void useLightParse() {
+		appendArgumentsAdjuster(tooling::getInsertArgumentAdjuster(
+			{"-Xclang", "-skip-function-bodies"},
+			tooling::ArgumentInsertPosition::END));
+	}
+
+	/// Reuse the changes stored in Dir for unchanged translation units that
+	/// ran with the same Config. See tool_support::ResultCache.
+	void useResultCache(StringRef Dir, StringRef Config) {
+		Results = std::make_unique<tool_support::ResultCache>(
+			Dir, Compilations, Config);
+	}
+
+	/// Profile the matchers of each rule, and report them to stderr and
+	/// JSONFile once the rules ran. See tool_support::MatcherProfile.
+	void profileMatchers(StringRef JSONFile) {
+		Profile = std::make_unique<tool_support::MatcherProfile>(JSONFile);
+	}
+
+	/// Release the memory of each translation unit right after matching, and
+	/// report the memory of the translation units once the rules ran. See
+	/// MemoryReport.
+	void useStreaming() {
+		Memory = std::make_unique<MemoryReport>();
+		CountAllocations = true;
+	}
+
+	/// Run the rules on all source files, apply all generated replacements,
+	/// and immediately save the results to disk.
+	///
+	/// \returns 0 upon success. Non-zero upon failure.
+	int runAndSave(ArrayRef<NamedRule> Rules) {
+		// The result cache, streaming, spilling and the prefilter work per
+		// translation unit, like runParallel
+		int Result = Jobs == 1 && !Results && !Memory && !MaxBufferedChanges &&
+							 !Prefilter
+						 ? runRules(*this, Rules, Changes)
+						 : runParallel(Rules);
+		if (Profile) {
+			Profile->report(llvm::errs());
+		}
+		if (Memory) {
+			Memory->print(llvm::errs());
+		}
+		if (Result) {
+			return Result;
+		}
+		if (!ChangesFile.empty()) {
+			return writeChanges() ? 0 : 1;
+		}
+
+		return applyAllChanges() ? 0 : 1;
+	}
+
+	/// Write the changes to File instead of applying them. See --shard.
+	void writeChangesTo(StringRef File) { ChangesFile = File.str(); }
+
+	/// Add the changes written to Files by writeChangesTo. Identical changes,
+	/// e.g. to a header included by the files of several shards, are only
+	/// added once.
+	/// \returns false if a file could not be read
+	bool mergeChanges(ArrayRef<std::string> Files) {
+		auto Logs = change_log::ChangeLogSet::open(Files);
+		if (!Logs) {
+			llvm::errs() << llvm::toString(Logs.takeError()) << "\n";
+			return false;
+		}
+		for (size_t F = 0; F < Logs->files(); ++F) {
+			auto Path = Logs->getFilePath(F);
+			auto Code = FS->getBufferForFile(Path);
+			if (!Code) {
+				llvm::errs() << "Could not read " << Path << ": "
+							 << Code.getError().message() << "\n";
+				return false;
+			}
+			tooling::AtomicChanges FileChanges;
+			if (auto Err = Logs->appendChanges(F, (*Code)->getBuffer(),
+											   FileChanges)) {
+				llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+				return false;
+			}
+			for (auto &Change : FileChanges) {
+				Changes.add(std::move(Change));
+			}
+		}
+		return true;
+	}
+
+	/// @brief Run the rules on every source file using a pool of `Jobs`
+	/// threads. Each translation unit gets its own ClangTool, MatchFinder and
+	/// change set, since none of them are thread safe. The translation
+	/// units are queued in order on the shared FIFO queue of llvm::ThreadPool,
+	/// which has no work stealing: an idle thread takes the next queued one,
+	/// so a few large files only stall the run if they are queued last.
+	/// Translation units found in the result cache are not parsed at all.
+	/// @param Rules - the rules to run on every translation unit
+	/// @return the same result code as ClangTool::run
+	int runParallel(ArrayRef<NamedRule> Rules) {
+		std::vector<ChangeSet> TUChanges(SourcePaths.size());
+		std::vector<int> TUResults(SourcePaths.size(), 0);
+
+		std::optional<token_prefilter::TokenPrefilter> Filter;
+		if (Prefilter) {
+			Filter = token_prefilter::makePrefilter(Rules);
+		}
+		std::atomic<size_t> Skipped = 0;
+
+		// Merge the changes in the same order as a serial run, as soon as
+		// all translation units before them are done. Past
+		// --max_buffered_changes, they are spilled to a change log.
+		std::mutex MergeMutex;
+		std::vector<char> Done(SourcePaths.size(), false);
+		size_t Merged = 0;
+		bool SpillFailed = false;
+		auto Merge = [&](size_t I) {
+			std::lock_guard<std::mutex> Lock(MergeMutex);
+			Done[I] = true;
+			for (; Merged < Done.size() && Done[Merged]; ++Merged) {
+				Changes.append(std::move(TUChanges[Merged]));
+			}
+			if (Memory) {
+				Memory->buffered(Changes.size());
+			}
+			if (MaxBufferedChanges && Changes.size() > MaxBufferedChanges &&
+				!SpillFailed) {
+				SpillFailed = !spillChanges();
+			}
 		};
+
+		llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+		for (size_t I = 0; I < SourcePaths.size(); ++I) {
+			Pool.async([&, I] {
+				auto MergeWhenDone =
+					llvm::make_scope_exit([&, I] { Merge(I); });
+				tool_support::TaskTrace Trace(
+					!TraceFile.empty(), "enum_to_string");
+				llvm::TimeTraceScope Scope("Translation unit", SourcePaths[I]);
+
+				// A file that cannot be read is left to the frontend
+				if (Filter) {
+					auto Code = FS->getBufferForFile(SourcePaths[I]);
+					if (Code && !Filter->mayMatch((*Code)->getBuffer())) {
+						++Skipped;
+						return;
+					}
+				}
+
+				if (Results) {
+					if (auto Cached = Results->replay(SourcePaths[I])) {
+						for (auto &Change : Cached->Changes) {
+							TUChanges[I].add(std::move(Change));
+						}
+						return;
+					}
+				}
+
+				if (Memory) {
+					resetPeakResidentMemory();
+				}
+				auto Allocations = ThreadAllocations;
+				auto AllocatedBytes = ThreadAllocatedBytes;
+				unsigned Files = 0;
+				{
+					// Every tool changes the working directory of its file
+					// system. The tool, and with it the file manager and the
+					// AST, is gone before the memory is measured.
+					tooling::ClangTool TUTool(
+						Compilations, SourcePaths[I], PCHContainerOps,
+						Rewritten ? Rewritten->getFileSystem() : FS);
+					for (const auto &Adjuster : Adjusters) {
+						TUTool.appendArgumentsAdjuster(Adjuster);
+					}
+					tool_support::CollectDependencies Deps;
+					TUResults[I] = runRules(TUTool, Rules, TUChanges[I], &Deps);
+					if (Results && TUResults[I] == 0) {
+						Results->store(SourcePaths[I],
+									   Deps.Deps->getDependencies(),
+									   TUChanges[I].changes());
+					}
+					Files = TUTool.getFiles().getNumUniqueRealFiles();
+				}
+				if (Memory) {
+					Memory->add({SourcePaths[I], readResidentMemory().second,
+								 ThreadAllocations - Allocations,
+								 ThreadAllocatedBytes - AllocatedBytes, Files});
+#ifdef __GLIBC__
+					// Give the freed memory back, so the resident memory of
+					// the next translation units does not include it
+					malloc_trim(0);
+#endif
+				}
+			});
+		}
+		Pool.wait();
+
+		if (Filter) {
+			llvm::errs() << "Prefilter skipped " << Skipped.load() << " of "
+						 << SourcePaths.size() << " translation units\n";
+		}
+		if (Results) {
+			Results->printStats(llvm::errs());
+		}
+		if (SpillFailed || !readSpilledChanges()) {
+			return 1;
+		}
+
+		// Same priority as ClangTool::run: failures before skipped files
+		if (llvm::is_contained(TUResults, 1)) {
+			return 1;
+		}
+		return llvm::is_contained(TUResults, 2) ? 2 : 0;
+	}
+
+	/// @brief Apply all the saved changes, and print the new code, a diff of
+	/// it, or write it back to disk, together with the generated source
+	/// files. Files are processed in parallel, and each file is written
+	/// atomically. Files whose code does not change are not written, so they
+	/// keep their modification time. Nothing is written if any file fails.
+	/// With --output=yaml, prints the changes instead of applying them. In a
+	/// pipeline, the new code is kept in memory for the next stage instead.
+	/// @return true if sucessfull
+	bool applyAllChanges() {
+		if (!Inplace && Output == OutputFormat::YAML) {
+			for (const auto &[File, FileChanges] : Changes) {
+				for (const auto &Change : FileChanges) {
+					llvm::outs() << Change.toYAMLString();
+				}
+			}
+			return true;
+		}
+
+		std::vector<FileUpdate> Updates;
+		if (!applyChanges(Updates)) {
+			return false;
+		}
+		for (auto &[File, Code] : generateDefinitionFiles()) {
+			auto OldCode = FS->getBufferForFile(File);
+			Updates.push_back({File, OldCode ? std::move(*OldCode) : nullptr,
+							   std::move(Code)});
+		}
+
+		if (Rewritten) {
+			// Nothing reads the old code through FS from here on
+			for (auto &Update : Updates) {
+				Rewritten->set(Update.File, std::move(Update.NewCode));
+			}
+			return true;
+		}
+		return output(Updates);
+	}
+
+	/// Print the new code of each file, a diff of it, or write it back to
+	/// disk, as selected by --in_place and --output. Files whose code does
+	/// not change are not written, and each file is written atomically.
+	/// \returns false if any file could not be written
+	static bool output(ArrayRef<FileUpdate> Updates) {
+		// Reading and writing is mostly waiting on I/O, so use all threads
+		llvm::ThreadPool Pool(llvm::hardware_concurrency());
+		if (!Inplace && Output == OutputFormat::Diff) {
+			// New files are diffed against /dev/null
+			std::vector<std::string> Diffs(Updates.size());
+			for (size_t I = 0; I < Updates.size(); ++I) {
+				Pool.async([&, I] {
+					const auto &Update = Updates[I];
+					std::optional<StringRef> Old;
+					if (Update.OldCode) {
+						Old = Update.OldCode->getBuffer();
+					}
+					llvm::raw_string_ostream Out(Diffs[I]);
+					printUnifiedDiff(Update.File, Old, Update.NewCode, Out);
+				});
+			}
+			Pool.wait();
+			for (const auto &FileDiff : Diffs) {
+				llvm::outs() << FileDiff;
+			}
+			return true;
+		}
+		if (!Inplace) {
+			for (const auto &Update : Updates) {
+				llvm::outs() << Update.NewCode;
+			}
+			return true;
+		}
+
+		std::vector<std::pair<StringRef, StringRef>> Writes;
+		for (const auto &Update : Updates) {
+			const auto &Old = Update.OldCode;
+			if (!Old || Old->getBuffer() != Update.NewCode) {
+				Writes.emplace_back(Update.File, Update.NewCode);
+			}
+		}
+		return tool_support::writeFiles(Pool, Writes);
 	}
 
   private:
-	tooling::AtomicChanges &Changes;
+	EnumStringGeneratorTool(const tooling::CompilationDatabase &Compilations,
+							ArrayRef<std::string> SourcePaths,
+							std::shared_ptr<PCHContainerOperations>
+								PCHContainerOps,
+							IntrusiveRefCntPtr<FileManager> Files,
+							RewrittenFiles *Rewritten,
+							IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+		: ClangTool(Compilations, SourcePaths, PCHContainerOps, FS,
+					std::move(Files)),
+		  Compilations(Compilations), SourcePaths(SourcePaths),
+		  PCHContainerOps(std::move(PCHContainerOps)), Rewritten(Rewritten),
+		  FS(std::move(FS)) {}
+
+	/// Apply all the saved changes to the code of each file in FS, in
+	/// parallel
+	/// \returns false if any file failed
+	bool applyChanges(std::vector<FileUpdate> &Updates) {
+		// FIXME: Add automatic formatting support as well.
+		tooling::ApplyChangesSpec Spec;
+		Spec.Style = format::getLLVMStyle();
+
+		std::vector<std::pair<StringRef, const tooling::AtomicChanges *>> Files;
+		for (const auto &[File, FileChanges] : Changes) {
+			Files.emplace_back(File, &FileChanges);
+		}
+		Updates.resize(Files.size());
+		std::vector<std::string> Errors(Files.size());
+
+		// Reading is mostly waiting on I/O, so use all threads
+		llvm::ThreadPool Pool(llvm::hardware_concurrency());
+		llvm::TimeTraceScope Scope("Apply changes");
+		for (size_t I = 0; I < Files.size(); ++I) {
+			Pool.async([&, I] {
+				auto [File, FileChanges] = Files[I];
+				auto Code = FS->getBufferForFile(File);
+				if (!Code) {
+					Errors[I] = "Could not read " + File.str() + ": " +
+								Code.getError().message();
+					return;
+				}
+				auto new_code = applyAtomicChanges(File, (*Code)->getBuffer(),
+												   *FileChanges, Spec);
+				if (!new_code) {
+					Errors[I] = llvm::toString(new_code.takeError());
+					return;
+				}
+				Updates[I] = {File.str(), std::move(*Code),
+							  std::move(new_code.get())};
+			});
+		}
+		Pool.wait();
+		return !tool_support::printErrors(Errors);
+	}
+
+	/// Move the changes, but not the definitions, to a new temporary change
+	/// log, see --max_buffered_changes
+	/// \returns false if the log could not be written
+	bool spillChanges() {
+		llvm::TimeTraceScope Scope("Spill changes");
+		int FD;
+		SmallString<128> Path;
+		if (auto EC = llvm::sys::fs::createTemporaryFile(
+				"enum_to_string-spill", "log", FD, Path)) {
+			llvm::errs() << "Could not spill the changes: " << EC.message()
+						 << "\n";
+			return false;
+		}
+		SpilledFiles.push_back(std::string(Path));
+
+		change_log::ChangeLogWriter Log;
+		for (const auto &[File, FileChanges] : Changes) {
+			for (const auto &Change : FileChanges) {
+				Log.add(Change);
+			}
+		}
+		llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+		Log.write(Out);
+		Out.close();
+		if (Out.has_error()) {
+			llvm::errs() << "Could not spill the changes to " << Path << ": "
+						 << Out.error().message() << "\n";
+			Out.clear_error();
+			return false;
+		}
+		if (Memory) {
+			Memory->spilled(Changes.size());
+		}
+		Changes.clearChanges();
+		return true;
+	}
+
+	/// Put the spilled changes back in front of the ones still in memory, in
+	/// the order they were spilled, and remove the spilled change logs
+	/// \returns false if a log could not be read
+	bool readSpilledChanges() {
+		if (SpilledFiles.empty()) {
+			return true;
+		}
+		auto Remove = llvm::make_scope_exit([&] {
+			for (const auto &File : SpilledFiles) {
+				llvm::sys::fs::remove(File);
+			}
+			SpilledFiles.clear();
+		});
+		llvm::TimeTraceScope Scope("Read spilled changes");
+		auto Buffered = std::move(Changes);
+		Changes = ChangeSet();
+		if (!mergeChanges(SpilledFiles)) {
+			return false;
+		}
+		Changes.append(std::move(Buffered));
+		return true;
+	}
+
+	/// Write all changes to ChangesFile as a change log
+	bool writeChanges() const {
+		change_log::ChangeLogWriter Log;
+		for (const auto &[File, FileChanges] : Changes) {
+			for (const auto &Change : FileChanges) {
+				Log.add(Change);
+			}
+		}
+		if (auto Err = llvm::writeToOutput(ChangesFile, [&](raw_ostream &Out) {
+				Log.write(Out);
+				return llvm::Error::success();
+			})) {
+			llvm::errs() << "Could not write " << ChangesFile << ": "
+						 << llvm::toString(std::move(Err)) << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	/// The path of File relative to the directory Dir, with '/' separators,
+	/// e.g. for an #include in a file in Dir
+	static std::string relativePath(StringRef File, StringRef Dir) {
+		SmallString<256> AbsFile(File), AbsDir(Dir);
+		llvm::sys::fs::make_absolute(AbsFile);
+		llvm::sys::fs::make_absolute(AbsDir);
+		llvm::sys::path::remove_dots(AbsFile, /*remove_dot_dot=*/true);
+		llvm::sys::path::remove_dots(AbsDir, /*remove_dot_dot=*/true);
+
+		auto FileIt = llvm::sys::path::begin(AbsFile);
+		auto FileEnd = llvm::sys::path::end(AbsFile);
+		auto DirIt = llvm::sys::path::begin(AbsDir);
+		auto DirEnd = llvm::sys::path::end(AbsDir);
+		while (FileIt != FileEnd && DirIt != DirEnd && *FileIt == *DirIt) {
+			++FileIt;
+			++DirIt;
+		}
+		SmallString<256> Relative;
+		for (; DirIt != DirEnd; ++DirIt) {
+			llvm::sys::path::append(Relative, "..");
+		}
+		for (; FileIt != FileEnd; ++FileIt) {
+			llvm::sys::path::append(Relative, *FileIt);
+		}
+		return llvm::sys::path::convert_to_slash(Relative);
+	}
+
+	/// The source files with the definitions of --out_of_line, by their path.
+	/// Each includes the files it has definitions for.
+	std::map<std::string, std::string> generateDefinitionFiles() const {
+		std::map<std::string, std::string> Generated;
+		for (const auto &[File, Definitions] : Changes.definitions()) {
+			SmallString<256> Path(File);
+			llvm::sys::path::replace_extension(Path, "to_string.cpp");
+			if (!DefinitionsFile.empty()) {
+				Path = DefinitionsFile;
+			}
+			auto &Code = Generated[std::string(Path)];
+			if (Code.empty()) {
+				Code = "// Generated by enum_to_string --out_of_line. Do not "
+					   "edit.\n\n#include <cstdint>\n#include <optional>\n"
+					   "#include <string_view>\n";
+			}
+
+			Code += "\n#include \"" +
+					relativePath(File, llvm::sys::path::parent_path(Path)) +
+					"\"\n";
+			for (const auto &Definition : Definitions) {
+				Code += Definition;
+			}
+		}
+		return Generated;
+	}
+
+	/// Register all the rules on a fresh MatchFinder, run them through Tool
+	/// and store the generated changes in Out.
+	int runRules(tooling::ClangTool &Tool, ArrayRef<NamedRule> Rules,
+				 ChangeSet &Out,
+				 tooling::SourceFileCallbacks *Callbacks = nullptr) {
+		llvm::StringMap<llvm::TimeRecord> Records;
+		ast_matchers::MatchFinder::MatchFinderOptions Options;
+		if (Profile) {
+			Options.CheckProfiling.emplace(Records);
+		}
+		ast_matchers::MatchFinder Finder(std::move(Options));
+		MyConsumer Consumer(Out);
+
+		using tool_support::NamedTransformer;
+		std::vector<std::unique_ptr<NamedTransformer>> Transformers;
+		for (const auto &Rule : Rules) {
+			Transformers.push_back(std::make_unique<NamedTransformer>(
+				Rule.Name, Rule.Rule,
+				Consumer.RefactorConsumer(Rule.Name,
+										  Rule.MetadataIsDefinition)));
+			Transformers.back()->registerMatchers(&Finder);
+		}
+
+		// The MatchFinder replaces the records for every translation unit
+		tool_support::MatchConsumerFactory Factory{Finder};
+		if (Profile) {
+			Factory.OnMatched = [&] {
+				for (const auto &RuleTransformer : Transformers) {
+					auto Rule = RuleTransformer->getID();
+					Profile->add(Rule, Records.lookup(Rule),
+								 RuleTransformer->takeMatches());
+				}
+				Records.clear();
+			};
+		}
+		return Tool.run(
+			tooling::newFrontendActionFactory(&Factory, Callbacks).get());
+	}
+
+	const tooling::CompilationDatabase &Compilations;
+	std::vector<std::string> SourcePaths;
+	std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+	std::vector<tooling::ArgumentsAdjuster> Adjusters;
+	std::unique_ptr<tool_support::PreambleCache> Preambles;
+	std::unique_ptr<tool_support::ResultCache> Results;
+	std::unique_ptr<tool_support::MatcherProfile> Profile;
+	std::unique_ptr<MemoryReport> Memory;
+	/// The change logs of --max_buffered_changes
+	std::vector<std::string> SpilledFiles;
+	std::string ChangesFile;
+	/// Where the new code goes in a pipeline, see runPipeline
+	RewrittenFiles *Rewritten;
+	/// The file system the code is read from
+	IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS;
+	ChangeSet Changes{};
 };
 
 /// Stencil for retrieving extra information of a node
@@ -172,6 +1312,7 @@ template <typename F,
 resType foreach_enum_const(StringRef Id, F callback) {
 	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
 			   -> Expected<std::string> {
+		llvm::TimeTraceScope Scope("Stencil", "foreach_enum_const");
 		if (auto enum_decl = Match.Nodes.getNodeAs<EnumDecl>(Id)) {
 			std::stringstream ss;
 			for (const auto enum_const : enum_decl->enumerators()) {
@@ -197,13 +1338,257 @@ resType case_enum_to_string(StringRef Id, const transformer::Stencil &getName) {
 			   "::" + enum_const_decl->getNameAsString() + ": return \"" +
 			   enum_const_decl->getNameAsString() + "\";\n";
 	};
-	return foreach_enum_const(Id, lambda);
+	auto stencil = foreach_enum_const(Id, lambda);
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match) {
+		llvm::TimeTraceScope Scope("Stencil", "case_enum_to_string");
+		return stencil(Match);
+	};
 }
 
-resType get_declarator_type_text(StringRef Id) {
+/// Body of to_string as a switch with a case per enumerator
+resType switch_enum_to_string(StringRef Id,
+							  const transformer::Stencil &getName) {
+	auto cases = case_enum_to_string(Id, getName);
 	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
 			   -> Expected<std::string> {
-		auto node = Match.Nodes.getNodeAs<DeclaratorDecl>(Id);
+		auto body = cases(Match);
+		if (!body) {
+			return body.takeError();
+		}
+		return "\tswitch(e) {\n" + *body + "\t}\n";
+	};
+}
+
+/// The literal for Value. The smallest long long has no literal of its own.
+static std::string long_long_literal(int64_t Value) {
+	if (Value == std::numeric_limits<int64_t>::min()) {
+		return "(" + std::to_string(Value + 1) + "LL - 1)";
+	}
+	return std::to_string(Value) + "LL";
+}
+
+/// Body of to_string as a lookup in a table of the names. If the enumerators
+/// use at least MinDensity of the values between the smallest and the largest,
+/// the table is indexed by the value, with "" for the unused values. Otherwise
+/// the values are kept in a sorted table next to the names, and searched with
+/// binary search. Values that do not fit in a long long fall back to the
+/// switch. Values without an enumerator give "".
+resType table_enum_to_string(StringRef Id, const transformer::Stencil &getName,
+							 double MinDensity) {
+	auto switch_body = switch_enum_to_string(Id, getName);
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		llvm::TimeTraceScope Scope("Stencil", "table_enum_to_string");
+		auto enum_decl = Match.Nodes.getNodeAs<EnumDecl>(Id);
+		if (!enum_decl) {
+			throw std::invalid_argument(
+				append_file_line("ID not bound or not EnumDecl: " + Id.str()));
+		}
+
+		// The first name of each value, by value
+		std::map<int64_t, std::string> names;
+		for (const auto enum_const : enum_decl->enumerators()) {
+			const auto &value = enum_const->getInitVal();
+			if (!value.isRepresentableByInt64()) {
+				return switch_body(Match);
+			}
+			names.emplace(value.getExtValue(), enum_const->getNameAsString());
+		}
+
+		auto min = names.begin()->first;
+		auto max = names.rbegin()->first;
+		auto range = static_cast<double>(max) - static_cast<double>(min) + 1;
+		std::string body;
+		if (names.size() >= MinDensity * range) {
+			body = "\tconstexpr std::string_view names[] = {";
+			uint64_t index = 0;
+			for (const auto &[value, name] : names) {
+				// Unsigned, since the range may not fit in an int64_t
+				auto offset = static_cast<uint64_t>(value) - min;
+				for (; index < offset; ++index) {
+					body += "\"\", ";
+				}
+				body += "\"" + name + "\", ";
+				++index;
+			}
+			body += "};\n"
+					"\tauto v = static_cast<long long>(e);\n"
+					"\treturn v >= " +
+					long_long_literal(min) + " && v <= " +
+					long_long_literal(max) + " ? names[v - " +
+					long_long_literal(min) +
+					"] : std::string_view();\n";
+			return body;
+		}
+
+		std::string values;
+		for (const auto &[value, name] : names) {
+			values += long_long_literal(value) + ", ";
+			body += "\"" + name + "\", ";
+		}
+		auto size = std::to_string(names.size());
+		return "\tconstexpr long long values[] = {" + values +
+			   "};\n"
+			   "\tconstexpr std::string_view names[] = {" +
+			   body +
+			   "};\n"
+			   "\tauto v = static_cast<long long>(e);\n"
+			   "\tunsigned long lo = 0, hi = " +
+			   size +
+			   ";\n"
+			   "\twhile (lo < hi) {\n"
+			   "\t\tauto mid = (lo + hi) / 2;\n"
+			   "\t\tif (values[mid] < v) lo = mid + 1; else hi = mid;\n"
+			   "\t}\n"
+			   "\treturn lo < " +
+			   size + " && values[lo] == v ? names[lo] : std::string_view();\n";
+	};
+}
+
+/// 32 bit FNV-1a of S, starting from Seed. The generated from_string has the
+/// same hash, see hash_enum_from_string.
+static uint32_t fnv1a(StringRef S, uint32_t Seed) {
+	uint32_t h = 2166136261u ^ Seed;
+	for (unsigned char c : S) {
+		h = (h ^ c) * 16777619u;
+	}
+	return h;
+}
+
+/// Flags a seed of perfect_hash as the slot itself
+static constexpr uint32_t direct_slot = 0x80000000u;
+
+/// Minimal perfect hash of Keys, with hash and displace: a key goes in bucket
+/// fnv1a(key, 0) % size, and in slot fnv1a(key, seeds[bucket]) % size. The
+/// seeds are searched bucket by bucket, largest first. Buckets with a single
+/// key get the slot itself as seed, flagged with direct_slot.
+struct perfect_hash {
+	explicit perfect_hash(const std::vector<std::string> &names)
+		: seeds(names.size()), keys(names.size(), unused) {
+		auto size = names.size();
+		std::vector<std::vector<size_t>> buckets(size);
+		for (size_t key = 0; key < size; ++key) {
+			buckets[fnv1a(names[key], 0) % size].push_back(key);
+		}
+		std::vector<size_t> order(size);
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			return buckets[a].size() > buckets[b].size();
+		});
+
+		size_t free_slot = 0;
+		std::vector<size_t> slots;
+		for (auto bucket : order) {
+			const auto &bucket_keys = buckets[bucket];
+			if (bucket_keys.size() == 1) {
+				while (keys[free_slot] != unused) {
+					++free_slot;
+				}
+				keys[free_slot] = bucket_keys[0];
+				seeds[bucket] = direct_slot | static_cast<uint32_t>(free_slot);
+				continue;
+			}
+			for (uint32_t seed = 1; !bucket_keys.empty(); ++seed) {
+				if (seed == direct_slot) {
+					throw std::runtime_error(append_file_line(
+						"No perfect hash for the enumerators"));
+				}
+				slots.clear();
+				for (auto key : bucket_keys) {
+					auto slot = fnv1a(names[key], seed) % size;
+					if (keys[slot] != unused ||
+						llvm::is_contained(slots, slot)) {
+						break;
+					}
+					slots.push_back(slot);
+				}
+				if (slots.size() == bucket_keys.size()) {
+					for (size_t i = 0; i < slots.size(); ++i) {
+						keys[slots[i]] = bucket_keys[i];
+					}
+					seeds[bucket] = seed;
+					break;
+				}
+			}
+		}
+	}
+
+	static constexpr size_t unused = std::numeric_limits<size_t>::max();
+
+	/// The seed of each bucket
+	std::vector<uint32_t> seeds;
+	/// The index in names of the key in each slot
+	std::vector<size_t> keys;
+};
+
+/// Body of from_string<Enum>(std::string_view s). Looks s up with a minimal
+/// perfect hash of the names of the enumerators, computed here, and compares
+/// it with the name in its slot.
+resType hash_enum_from_string(StringRef Id,
+							  const transformer::Stencil &getName) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		llvm::TimeTraceScope Scope("Stencil", "hash_enum_from_string");
+		auto enum_decl = Match.Nodes.getNodeAs<EnumDecl>(Id);
+		if (!enum_decl) {
+			throw std::invalid_argument(
+				append_file_line("ID not bound or not EnumDecl: " + Id.str()));
+		}
+		auto ns = getName->eval(Match);
+		if (!ns) {
+			return ns.takeError();
+		}
+
+		std::vector<std::string> names;
+		for (const auto enum_const : enum_decl->enumerators()) {
+			names.push_back(enum_const->getNameAsString());
+		}
+		perfect_hash hash(names);
+
+		std::string seeds;
+		for (auto seed : hash.seeds) {
+			seeds += std::to_string(seed) + "u, ";
+		}
+		std::string slot_names, slot_values;
+		for (auto key : hash.keys) {
+			slot_names += "\"" + names[key] + "\", ";
+			slot_values += ns.get() + "::" + names[key] + ", ";
+		}
+		auto size = std::to_string(names.size());
+		return "\tconstexpr std::uint32_t seeds[] = {" + seeds +
+			   "};\n"
+			   "\tconstexpr std::string_view names[] = {" +
+			   slot_names +
+			   "};\n"
+			   "\tconstexpr " +
+			   ns.get() + " values[] = {" + slot_values +
+			   "};\n"
+			   "\tauto hash = [](std::string_view s, std::uint32_t seed) {\n"
+			   "\t\tstd::uint32_t h = 2166136261u ^ seed;\n"
+			   "\t\tfor (unsigned char c : s) {\n"
+			   "\t\t\th = (h ^ c) * 16777619u;\n"
+			   "\t\t}\n"
+			   "\t\treturn h;\n"
+			   "\t};\n"
+			   "\tauto seed = seeds[hash(s, 0) % " +
+			   size +
+			   "];\n"
+			   "\tauto slot = seed & 0x80000000u ? seed & 0x7fffffffu : "
+			   "hash(s, seed) % " +
+			   size +
+			   ";\n"
+			   "\tif (names[slot] == s) {\n"
+			   "\t\treturn values[slot];\n"
+			   "\t}\n"
+			   "\treturn std::nullopt;\n";
+	};
+}
+
+resType get_declarator_type_text(StringRef Id) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		llvm::TimeTraceScope Scope("Stencil", "get_declarator_type_text");
+		auto node = Match.Nodes.getNodeAs<DeclaratorDecl>(Id);
 		if (!node) {
 			throw std::invalid_argument(append_file_line(
 				"ID not bound or not DeclaratorDecl: " + Id.str()));
@@ -216,8 +1601,183 @@ resType get_declarator_type_text(StringRef Id) {
 	};
 }
 
+/// The fully qualified name of the NamedDecl bound to Id
+resType get_qualified_name(StringRef Id) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		auto node = Match.Nodes.getNodeAs<NamedDecl>(Id);
+		if (!node) {
+			throw std::invalid_argument(
+				append_file_line("ID not bound or not NamedDecl: " + Id.str()));
+		}
+		return node->getQualifiedNameAsString();
+	};
+}
+
+/// The qualifier naming the context of the Decl bound to Id, e.g. "a::b::".
+/// Empty in the global namespace.
+resType get_context_qualifier(StringRef Id) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		auto node = Match.Nodes.getNodeAs<Decl>(Id);
+		if (!node) {
+			throw std::invalid_argument(
+				append_file_line("ID not bound or not Decl: " + Id.str()));
+		}
+		auto context = dyn_cast<NamedDecl>(node->getDeclContext());
+		if (!context) {
+			return "";
+		}
+		return context->getQualifiedNameAsString() + "::";
+	};
+}
+
+/// ";" if the FunctionDecl bound to Id is a definition. Replacing a definition
+/// by a declaration needs it, as the range of a declaration ends before its
+/// ';'.
+resType semicolon_if_definition(StringRef Id) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		auto node = Match.Nodes.getNodeAs<FunctionDecl>(Id);
+		if (!node) {
+			throw std::invalid_argument(append_file_line(
+				"ID not bound or not FunctionDecl: " + Id.str()));
+		}
+		return node->doesThisDeclarationHaveABody() ? ";" : "";
+	};
+}
+
+/// Fails with an error at the Decl bound to Id, which --out_of_line would
+/// define in a file including a source file
+resType out_of_line_in_source(StringRef Id) {
+	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
+			   -> Expected<std::string> {
+		auto node = Match.Nodes.getNodeAs<Decl>(Id);
+		if (!node) {
+			throw std::invalid_argument(
+				append_file_line("ID not bound or not Decl: " + Id.str()));
+		}
+		return llvm::createStringError(
+			llvm::inconvertibleErrorCode(),
+			node->getLocation().printToString(*Match.SourceManager) +
+				": --out_of_line only applies to enums in headers, as the "
+				"generated file includes the file of the enum");
+	};
+}
+
 }	// end namespace NodeOps
 
+/// Index of the existing `to_string(Enum)` and `from_string` methods of a
+/// translation unit, keyed by the canonical declaration of the enum. It is
+/// built with a single traversal of the translation unit the first time it is
+/// requested and lives as long as the ASTContext it was built from.
+class EnumFunctionIndex {
+  public:
+	/// Return the index for the translation unit of Ctx. Builds it if needed.
+	static const EnumFunctionIndex &get(ASTContext &Ctx) {
+		{
+			std::lock_guard<std::mutex> Lock(IndicesMutex);
+			auto It = Indices.find(&Ctx);
+			if (It != Indices.end()) {
+				return *It->second;
+			}
+		}
+
+		// Build outside the lock. A context is only ever used by one thread.
+		std::unique_ptr<EnumFunctionIndex> Index(new EnumFunctionIndex(Ctx));
+		Ctx.AddDeallocation(
+			[](void *Ctx) {
+				std::lock_guard<std::mutex> Lock(IndicesMutex);
+				Indices.erase(static_cast<const ASTContext *>(Ctx));
+			},
+			&Ctx);
+
+		std::lock_guard<std::mutex> Lock(IndicesMutex);
+		return *(Indices[&Ctx] = std::move(Index));
+	}
+
+	/// Return the first to_string method found for Enum. nullptr if none.
+	const FunctionDecl *lookupToString(const EnumDecl &Enum) const {
+		return ToStrings.lookup(Enum.getCanonicalDecl());
+	}
+
+	/// Return the first from_string method found for Enum. nullptr if none.
+	const FunctionDecl *lookupFromString(const EnumDecl &Enum) const {
+		return FromStrings.lookup(Enum.getCanonicalDecl());
+	}
+
+  private:
+	struct Collector : public RecursiveASTVisitor<Collector> {
+		explicit Collector(EnumFunctionIndex &Index) : Index(Index) {}
+
+		/// Same requirements as the previous `hasDescendant` matcher for
+		/// to_string: one parameter, and the parameter type written as an
+		/// (elaborated) enum type. A from_string has one parameter and returns
+		/// std::optional of the enum, like the generated one.
+		bool VisitFunctionDecl(FunctionDecl *FD) {
+			if (FD->getNumParams() != 1 || !FD->getIdentifier()) {
+				return true;
+			}
+			if (FD->getName() == "from_string") {
+				if (auto *Enum = getOptionalEnum(FD->getReturnType())) {
+					Index.FromStrings.try_emplace(Enum->getCanonicalDecl(), FD);
+				}
+				return true;
+			}
+			if (FD->getName() != "to_string") {
+				return true;
+			}
+			auto *Elaborated = dyn_cast<ElaboratedType>(
+				FD->getParamDecl(0)->getType().getTypePtr());
+			if (!Elaborated) {
+				return true;
+			}
+			if (auto *Enum = dyn_cast<EnumType>(
+					Elaborated->getNamedType().getTypePtr())) {
+				// Keep the first one, like `hasDescendant` would
+				Index.ToStrings.try_emplace(Enum->getDecl()->getCanonicalDecl(),
+											FD);
+			}
+			return true;
+		}
+
+		/// The enum of std::optional<Enum>. nullptr for other types.
+		static const EnumDecl *getOptionalEnum(QualType Type) {
+			auto *Optional = dyn_cast_or_null<ClassTemplateSpecializationDecl>(
+				Type->getAsCXXRecordDecl());
+			if (!Optional || !Optional->isInStdNamespace() ||
+				Optional->getName() != "optional") {
+				return nullptr;
+			}
+			const auto &Args = Optional->getTemplateArgs();
+			if (Args.size() != 1 ||
+				Args[0].getKind() != TemplateArgument::Type) {
+				return nullptr;
+			}
+			auto *Enum = Args[0].getAsType()->getAs<EnumType>();
+			return Enum ? Enum->getDecl() : nullptr;
+		}
+
+		EnumFunctionIndex &Index;
+	};
+
+	explicit EnumFunctionIndex(ASTContext &Ctx) {
+		Collector(*this).TraverseDecl(Ctx.getTranslationUnitDecl());
+	}
+
+	llvm::DenseMap<const EnumDecl *, const FunctionDecl *> ToStrings;
+	llvm::DenseMap<const EnumDecl *, const FunctionDecl *> FromStrings;
+
+	static std::mutex IndicesMutex;
+	static llvm::DenseMap<const ASTContext *,
+						  std::unique_ptr<EnumFunctionIndex>>
+		Indices;
+};
+
+std::mutex EnumFunctionIndex::IndicesMutex;
+llvm::DenseMap<const ASTContext *, std::unique_ptr<EnumFunctionIndex>>
+	EnumFunctionIndex::Indices;
+
 namespace matchers {
 
 /// Warning: Use at own risk. Might match multiple types e.g. on record
@@ -261,45 +1821,195 @@ AST_MATCHER(NamedDecl, is_named) {
 	return Node.getIdentifier();   // nullptr if no name
 }
 
+/// Matches if the main file of the translation unit is a header, judged by its
+/// extension
+AST_MATCHER(Decl, is_in_header_main_file) {
+	const auto &SM = Finder->getASTContext().getSourceManager();
+	auto File = SM.getFilename(SM.getLocForStartOfFile(SM.getMainFileID()));
+	return llvm::StringSwitch<bool>(llvm::sys::path::extension(File))
+		.Cases(".h", ".hh", ".hpp", ".hxx", ".h++", true)
+		.Cases(".inc", ".inl", ".ipp", ".tcc", true)
+		.Default(false);
+}
+
+/// Matches enums that already have a to_string method somewhere in the
+/// translation unit. Binds the method to FunctionId and its parameter to
+/// ParmId. Uses EnumFunctionIndex, so the translation unit is only traversed
+/// once instead of once per enum.
+AST_MATCHER_P2(EnumDecl, has_existing_to_string, std::string, FunctionId,
+			   std::string, ParmId) {
+	auto existing =
+		EnumFunctionIndex::get(Finder->getASTContext()).lookupToString(Node);
+	if (!existing) {
+		return false;
+	}
+	Builder->setBinding(FunctionId, DynTypedNode::create(*existing));
+	Builder->setBinding(ParmId,
+						DynTypedNode::create(*existing->getParamDecl(0)));
+	return true;
+}
+
+/// Matches enums that already have a from_string method somewhere in the
+/// translation unit, and binds it to FunctionId. See has_existing_to_string.
+AST_MATCHER_P(EnumDecl, has_existing_from_string, std::string, FunctionId) {
+	auto existing =
+		EnumFunctionIndex::get(Finder->getASTContext()).lookupFromString(Node);
+	if (!existing) {
+		return false;
+	}
+	Builder->setBinding(FunctionId, DynTypedNode::create(*existing));
+	return true;
+}
+
 }	// namespace matchers
 
-int main(int argc, const char **argv) {
-	// Configuring the command-line options
-	auto ExpectedParser =
-		clang::tooling::CommonOptionsParser::create(argc, argv, MyToolCategory);
-	if (!ExpectedParser) {
-		// Fail gracefully for unsupported options.
-		llvm::errs() << ExpectedParser.takeError();
-		return 1;
+/// The body of to_string for the enum bound to "enumDecl", called Name
+static transformer::Stencil to_string_body(const transformer::Stencil &Name) {
+	return transformer::run(
+		ToStringTable
+			? NodeOps::table_enum_to_string("enumDecl", Name, TableDensity)
+			: NodeOps::switch_enum_to_string("enumDecl", Name));
+}
+
+/// Rule defining to_string (and from_string) right after every enum in the
+/// main file, or replacing the existing ones
+static RuleType makeInlineEnumRule(const DeclarationMatcher &enumFinder,
+								   const transformer::Stencil &name,
+								   const transformer::Stencil &metadata) {
+	// from_string is a specialization, since overloads cannot differ by
+	// their return type only
+	auto from_string = transformer::cat(
+		"\n\ntemplate <typename E> constexpr std::optional<E> "
+		"from_string(std::string_view s);\n\ntemplate <> constexpr "
+		"std::optional<",
+		name, "> from_string<", name, ">(std::string_view s){\n",
+		transformer::run(NodeOps::hash_enum_from_string("enumDecl", name)),
+		"}");
+
+	// The new from_string goes next to to_string, unless there is one
+	auto to_string = transformer::changeTo(
+		transformer::ifBound("toString", transformer::node("toString"),
+							 transformer::after(transformer::node("enumDecl"))),
+		transformer::cat(
+			// to_string method
+			"\n\nconstexpr std::string_view to_string(", name, " e){\n",
+			to_string_body(name), "}",
+			FromString ? transformer::ifBound("fromString", transformer::cat(),
+											  from_string)
+					   : transformer::cat()));
+
+	llvm::SmallVector<transformer::ASTEdit, 1> edits = {
+		addInclude("string_view", transformer::IncludeFormat::Angled),
+		addInclude("stdexcept", transformer::IncludeFormat::Angled), to_string};
+	if (!FromString) {
+		return transformer::makeRule(enumFinder, edits, metadata);
 	}
-	clang::tooling::CommonOptionsParser &OptionsParser = ExpectedParser.get();
+	return transformer::makeRule(
+		enumFinder,
+		transformer::flatten(
+			transformer::editList(edits),
+			addInclude("optional", transformer::IncludeFormat::Angled),
+			addInclude("cstdint", transformer::IncludeFormat::Angled),
+			transformer::ifBound(
+				"fromString",
+				transformer::edit(transformer::changeTo(
+					transformer::node("fromString"), from_string)),
+				transformer::noEdits())),
+		metadata);
+}
 
-	// Using refactoring tool since it allows `runAndSave` instead of `run`
-	EnumStringGeneratorTool tool(OptionsParser.getCompilations(),
-								 OptionsParser.getSourcePathList());
-
-	// NOTE: We currently bind namespace - which turned out to be unnecessary
-	// but quite a learning experience
-	auto has_enum_to_string =
-		functionDecl(
-			hasName("to_string"), parameterCountIs(1),
-			hasParameter(
-				0,
-				parmVarDecl(
-					hasType(elaboratedType(
-						namesType(hasDeclaration(equalsBoundNode("enumDecl"))),
-						optionally(
-							hasQualifier(matchers::rec_specifies_namespace(
-								namespaceDecl().bind("namespace")))))))
-					.bind("parmVar")))
-			.bind("toString");
+/// Rule declaring to_string (and from_string) right after every enum in the
+/// main file, or replacing the existing ones. The definitions are the
+/// metadata, written with qualified names for the generated source file. The
+/// replacements keep the code of existing declarations as is, so running the
+/// rule again does not change the file.
+static RuleType makeOutOfLineEnumRule(const DeclarationMatcher &enumFinder,
+									  const transformer::Stencil &name) {
+	auto qualified_name =
+		transformer::run(NodeOps::get_qualified_name("enumDecl"));
+	auto qualifier =
+		transformer::run(NodeOps::get_context_qualifier("enumDecl"));
 
+	auto to_string =
+		transformer::cat("std::string_view to_string(", name, " e)");
+	auto from_string = transformer::cat("template <> std::optional<", name,
+										"> from_string<", name,
+										">(std::string_view s)");
+	auto from_string_template = transformer::cat(
+		"template <typename E> std::optional<E> from_string(std::string_view "
+		"s);\n\n");
+
+	// A replaced definition loses its body, and needs a ';' instead. A
+	// replaced declaration keeps its ';', after the last declaration.
+	auto declarations = transformer::changeTo(
+		transformer::ifBound("toString", transformer::node("toString"),
+							 transformer::after(transformer::node("enumDecl"))),
+		transformer::ifBound(
+			"toString",
+			transformer::cat(
+				to_string,
+				FromString ? transformer::ifBound(
+								 "fromString", transformer::cat(),
+								 transformer::cat(";\n\n", from_string_template,
+												  from_string))
+						   : transformer::cat(),
+				transformer::run(
+					NodeOps::semicolon_if_definition("toString"))),
+			transformer::cat(
+				"\n\n", to_string, ";",
+				FromString ? transformer::ifBound(
+								 "fromString", transformer::cat(),
+								 transformer::cat("\n\n", from_string_template,
+												  from_string, ";"))
+						   : transformer::cat())));
+
+	auto definitions = transformer::cat(
+		"\nstd::string_view ", qualifier, "to_string(", qualified_name,
+		" e){\n", to_string_body(qualified_name), "}\n",
+		FromString
+			? transformer::cat(
+				  "\ntemplate <> std::optional<", qualified_name, "> ",
+				  qualifier, "from_string<", qualified_name,
+				  ">(std::string_view s){\n",
+				  transformer::run(NodeOps::hash_enum_from_string(
+					  "enumDecl", qualified_name)),
+				  "}\n")
+			: transformer::cat());
+
+	llvm::SmallVector<transformer::ASTEdit, 1> edits = {
+		addInclude("string_view", transformer::IncludeFormat::Angled),
+		declarations};
+	if (!FromString) {
+		return transformer::makeRule(enumFinder, edits, definitions);
+	}
+	return transformer::makeRule(
+		enumFinder,
+		transformer::flatten(
+			transformer::editList(edits),
+			addInclude("optional", transformer::IncludeFormat::Angled),
+			transformer::ifBound(
+				"fromString",
+				transformer::edit(transformer::changeTo(
+					transformer::node("fromString"),
+					transformer::cat(from_string,
+									 transformer::run(
+										 NodeOps::semicolon_if_definition(
+											 "fromString"))))),
+				transformer::noEdits())),
+		definitions);
+}
+
+/// Rule generating a to_string function for every enum in the main file, or
+/// replacing the existing one. With --out_of_line, the enums that can be
+/// named from another file only get declarations, and the definitions are
+/// the metadata of the rule.
+RuleType makeEnumRule() {
 	auto enumFinder = enumDecl(
 		isExpansionInMainFile(),
 		has(enumConstantDecl(hasDeclContext(enumDecl().bind("enumDecl")))),
 		matchers::is_named(),
-		optionally(
-			matchers::has_rec_decl_context(hasDescendant(has_enum_to_string))));
+		optionally(matchers::has_existing_to_string("toString", "parmVar")),
+		optionally(matchers::has_existing_from_string("fromString")));
 
 	auto print_correct_name = transformer::ifBound(
 		"toString",	  // if toString bound
@@ -307,30 +2017,450 @@ int main(int argc, const char **argv) {
 			"parmVar")),   // Print name based on parmVar
 		transformer::cat(
 			transformer::name("enumDecl")));   // Print name based on enumDecl
-	auto enumRule = transformer::makeRule(
-		enumFinder,
-		{addInclude("string_view", transformer::IncludeFormat::Angled),
-		 addInclude("stdexcept", transformer::IncludeFormat::Angled),
-		 transformer::changeTo(
-			 transformer::ifBound(
-				 "toString", transformer::node("toString"),
-				 transformer::after(transformer::node("enumDecl"))),
-			 transformer::cat(
-				 // to_string method
-				 "\n\nconstexpr std::string_view to_string(",
-				 print_correct_name, " e){\n\tswitch(e) {\n",
-				 transformer::run(NodeOps::case_enum_to_string(
-					 "enumDecl", print_correct_name)),
-				 "\t}\n}"))},
-		transformer::cat("Found something"));
-
-	ast_matchers::MatchFinder finder;
-	MyConsumer consumer(tool.getChanges());
-
-	tooling::Transformer transformer{enumRule, consumer.RefactorConsumer()};
-	transformer.registerMatchers(&finder);
+
+	if (!OutOfLine) {
+		return makeInlineEnumRule(enumFinder, print_correct_name,
+								  transformer::cat("Found something"));
+	}
+	// Enums in functions and anonymous namespaces keep their definitions. An
+	// empty metadata has no definition. The generated file includes the main
+	// file, so the enums of a source file are an error.
+	auto outOfLineFinder = enumDecl(
+		enumFinder, unless(isInAnonymousNamespace()),
+		hasDeclContext(
+			anyOf(translationUnitDecl(), namespaceDecl(), cxxRecordDecl())));
+	return transformer::applyFirst(
+		{makeOutOfLineEnumRule(
+			 enumDecl(outOfLineFinder, matchers::is_in_header_main_file()),
+			 print_correct_name),
+		 transformer::makeRule(
+			 outOfLineFinder,
+			 transformer::changeTo(
+				 transformer::node("enumDecl"),
+				 transformer::run(NodeOps::out_of_line_in_source("enumDecl")))),
+		 makeInlineEnumRule(enumFinder, print_correct_name,
+							transformer::cat(""))});
+}
+
+/// The rules and the options that change what they generate, so the result
+/// cache does not replay the changes of a run with other ones
+static std::string getResultCacheConfig(ArrayRef<NamedRule> Rules) {
+	std::string Config;
+	llvm::raw_string_ostream OS(Config);
+	for (const auto &Rule : Rules) {
+		OS << Rule.Name << ' ';
+	}
+	OS << "to_string_table=" << ToStringTable.getValue()
+	   << " table_density=" << TableDensity.getValue()
+	   << " from_string=" << FromString.getValue()
+	   << " light_parse=" << LightParse.getValue();
+	return Config;
+}
+
+/// The merge step of --shard: apply the changes of all shards, once each
+int mergeAndApply(ArrayRef<std::string> ChangesFiles) {
+	tooling::FixedCompilationDatabase Compilations(".", {});
+	EnumStringGeneratorTool Tool(Compilations, {});
+	return Tool.mergeChanges(ChangesFiles) && Tool.applyAllChanges() ? 0 : 1;
+}
+
+/// Run Rules with the parsed options. Name is the process name in the trace.
+/// Files is reused between the requests of the server, see ToolServer. With
+/// Rewritten, the rules run on the rewritten code and their changes are
+/// applied to it, see runPipeline.
+int run(tooling::CommonOptionsParser &OptionsParser, StringRef Name,
+		ArrayRef<NamedRule> Rules,
+		IntrusiveRefCntPtr<FileManager> Files = nullptr,
+		RewrittenFiles *Rewritten = nullptr) {
+	if (TableDensity <= 0 || TableDensity > 1) {
+		llvm::errs() << "--table_density must be above 0 and at most 1\n";
+		return 1;
+	}
+	// The result cache only keeps the changes, not the definitions
+	if (OutOfLine && !ResultCacheDir.empty()) {
+		llvm::errs() << "--out_of_line cannot be used with --result_cache\n";
+		return 1;
+	}
+	if (Inplace && Output != OutputFormat::Code) {
+		llvm::errs() << "--output only applies without --in_place\n";
+		return 1;
+	}
+	// The definitions are not AtomicChanges
+	if (OutOfLine && Output == OutputFormat::YAML) {
+		llvm::errs() << "--out_of_line cannot be used with --output=yaml\n";
+		return 1;
+	}
+	if (OutOfLine && !ShardOutput.empty()) {
+		llvm::errs() << "--out_of_line cannot be used with --shard_output\n";
+		return 1;
+	}
+
+	// Each shard only sees its own files, so it must not apply the changes to
+	// the headers they share with other shards
+	auto Sources = OptionsParser.getSourcePathList();
+	if (!Shard.empty()) {
+		unsigned Index, Count;
+		if (!tool_support::parseShard(Shard, Index, Count)) {
+			llvm::errs() << "--shard must be i/N with i < N\n";
+			return 1;
+		}
+		if (ShardOutput.empty()) {
+			llvm::errs() << "--shard requires --shard_output\n";
+			return 1;
+		}
+		llvm::erase_if(Sources, [&](const std::string &Source) {
+			return !tool_support::isInShard(Source, Index, Count);
+		});
+	}
+
+	// Using refactoring tool since it allows `runAndSave` instead of `run`
+	EnumStringGeneratorTool tool(OptionsParser.getCompilations(), Sources,
+								 std::make_shared<PCHContainerOperations>(),
+								 std::move(Files), Rewritten);
+	if (!ShardOutput.empty()) {
+		tool.writeChangesTo(ShardOutput);
+	}
+	if (LightParse) {
+		tool.useLightParse();
+	}
+	if (!PCHCache.empty()) {
+		tool.usePreambleCache(PCHCache);
+	}
+	if (!ResultCacheDir.empty()) {
+		tool.useResultCache(ResultCacheDir, getResultCacheConfig(Rules));
+	}
+	if (!ProfileMatchers.empty()) {
+		tool.profileMatchers(ProfileMatchers);
+	}
+	if (Streaming) {
+		tool.useStreaming();
+	}
 
 	// Run the tool and save the changes on disk immediately.
 	// See clang/tools/clang-rename/ClangRename.cpp:190-237 for other options
-	return tool.runAndSave(tooling::newFrontendActionFactory(&finder).get());
+	if (!TraceFile.empty()) {
+		llvm::timeTraceProfilerInitialize(0, Name);
+	}
+	int Result = tool.runAndSave(Rules);
+	if (llvm::timeTraceProfilerEnabled()) {
+		if (auto Err = llvm::timeTraceProfilerWrite(TraceFile, TraceFile)) {
+			llvm::errs() << "Could not write the trace: "
+						 << llvm::toString(std::move(Err)) << "\n";
+		}
+		llvm::timeTraceProfilerCleanup();
+	}
+	return Result;
+}
+
+/// Run each of Stages on the code rewritten by the stages before it. The
+/// rewritten code is kept in memory, and only printed or written once all
+/// stages succeeded, so a failing stage leaves every file untouched.
+int runPipeline(tooling::CommonOptionsParser &OptionsParser, StringRef Name,
+				ArrayRef<std::vector<NamedRule>> Stages) {
+	// The caches are keyed by the code on disk, and the changes of a stage
+	// only apply to the code of the stage before it
+	if (!PCHCache.empty() || !ResultCacheDir.empty()) {
+		llvm::errs() << "A pipeline cannot be used with --pch_cache or "
+						"--result_cache\n";
+		return 1;
+	}
+	if (!ShardOutput.empty() || Output == OutputFormat::YAML) {
+		llvm::errs() << "A pipeline cannot be used with --shard_output or "
+						"--output=yaml\n";
+		return 1;
+	}
+
+	RewrittenFiles Rewritten;
+	for (const auto &Rules : Stages) {
+		if (int Result =
+				run(OptionsParser, Name, Rules, nullptr, &Rewritten)) {
+			llvm::errs() << "The pipeline failed, no file was changed\n";
+			return Result;
+		}
+	}
+
+	// Compare with the code on disk, not the code of the last stage
+	std::vector<EnumStringGeneratorTool::FileUpdate> Updates;
+	for (const auto &[File, Code] : Rewritten.files()) {
+		auto OldCode = llvm::MemoryBuffer::getFile(File);
+		Updates.push_back(
+			{File, OldCode ? std::move(*OldCode) : nullptr, Code});
+	}
+	return EnumStringGeneratorTool::output(Updates) ? 0 : 1;
+}
+
+/// Long-running server for the tool, so repeated invocations do not pay for
+/// process startup, LLVM initialization and re-reading the same files.
+///
+/// A request is sent by enum_to_string_client over a Unix socket. It carries
+/// the client's stdout and stderr (as SCM_RIGHTS), followed by the length of
+/// the payload and the payload itself: the working directory and the
+/// arguments, each terminated by '\0'. The server runs the tool with the
+/// client's output as its own and replies with the exit code as an int.
+///
+/// A request runs the tool as the user of the server, and can rewrite any file
+/// the server can. The socket is created with permissions 0600, by default in
+/// a private directory (see socket_path.h), and clients of other users are
+/// rejected.
+///
+/// Requests are handled one at a time, since they change the working
+/// directory and the standard streams of the process. The FileManager and its
+/// stat cache are kept between requests, until one of the files it has seen
+/// changes on disk. Precompiled preambles stay on disk (see `--pch_cache`).
+class ToolServer {
+  public:
+	explicit ToolServer(StringRef SocketPath) : SocketPath(SocketPath) {}
+
+	/// Serve requests until the process is killed
+	///
+	/// \returns non-zero if the socket could not be set up.
+	int serve() {
+		sockaddr_un Addr{};
+		Addr.sun_family = AF_UNIX;
+		if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+			llvm::errs() << "Socket path too long: " << SocketPath << "\n";
+			return 1;
+		}
+		std::copy(SocketPath.begin(), SocketPath.end(), Addr.sun_path);
+
+		int Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(SocketPath.c_str());
+		// Only the user can connect, from the moment the socket exists
+		mode_t Umask = umask(0177);
+		bool Bound = Socket >= 0 && !bind(Socket,
+										  reinterpret_cast<sockaddr *>(&Addr),
+										  sizeof(Addr));
+		umask(Umask);
+		if (!Bound || listen(Socket, SOMAXCONN)) {
+			llvm::errs() << "Could not listen on " << SocketPath << ": "
+						 << llvm::sys::StrError() << "\n";
+			return 1;
+		}
+		llvm::errs() << "Listening on " << SocketPath << "\n";
+
+		while (true) {
+			int Client = accept(Socket, nullptr, nullptr);
+			if (Client < 0) {
+				if (errno != EINTR) {
+					llvm::errs() << "accept: " << llvm::sys::StrError() << "\n";
+				}
+				continue;
+			}
+			if (isSameUser(Client)) {
+				handleRequest(Client);
+			} else {
+				llvm::errs() << "Rejected a client of another user\n";
+			}
+			close(Client);
+		}
+	}
+
+  private:
+	/// Whether the process at the other end of Client runs as our user
+	static bool isSameUser(int Client) {
+#ifdef SO_PEERCRED
+		ucred Credentials{};
+		socklen_t Size = sizeof(Credentials);
+		return !getsockopt(Client, SOL_SOCKET, SO_PEERCRED, &Credentials,
+						   &Size) &&
+			   Credentials.uid == getuid();
+#else
+		uid_t Uid;
+		gid_t Gid;
+		return !getpeereid(Client, &Uid, &Gid) && Uid == getuid();
+#endif
+	}
+
+	void handleRequest(int Client) {
+		// The header: the client's stdout and stderr, and the payload size
+		uint32_t Size = 0;
+		iovec IOV{&Size, sizeof(Size)};
+		alignas(cmsghdr) char Control[CMSG_SPACE(2 * sizeof(int))];
+		msghdr Msg{};
+		Msg.msg_iov = &IOV;
+		Msg.msg_iovlen = 1;
+		Msg.msg_control = Control;
+		Msg.msg_controllen = sizeof(Control);
+		auto *Cmsg = recvmsg(Client, &Msg, 0) == sizeof(Size)
+						 ? CMSG_FIRSTHDR(&Msg)
+						 : nullptr;
+		if (!Cmsg || Cmsg->cmsg_type != SCM_RIGHTS ||
+			Cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+			llvm::errs() << "Malformed request\n";
+			return;
+		}
+		int Fds[2];
+		std::memcpy(Fds, CMSG_DATA(Cmsg), sizeof(Fds));
+
+		std::string Payload(Size, '\0');
+		if (!readAll(Client, Payload.data(), Size) || Size == 0) {
+			llvm::errs() << "Malformed request\n";
+			close(Fds[0]);
+			close(Fds[1]);
+			return;
+		}
+		SmallVector<StringRef> Parts;
+		StringRef(Payload).drop_back().split(Parts, '\0');
+
+		// Run the tool in the client's directory with the client's output
+		int Result = 1;
+		llvm::outs().flush();
+		llvm::errs().flush();
+		int SavedOut = dup(STDOUT_FILENO), SavedErr = dup(STDERR_FILENO);
+		dup2(Fds[0], STDOUT_FILENO);
+		dup2(Fds[1], STDERR_FILENO);
+		if (chdir(Parts.front().str().c_str())) {
+			llvm::errs() << "Could not enter " << Parts.front() << "\n";
+		} else {
+			Result = runRequest(ArrayRef<StringRef>(Parts).drop_front());
+		}
+		llvm::outs().flush();
+		std::cout.flush();
+		llvm::errs().flush();
+		dup2(SavedOut, STDOUT_FILENO);
+		dup2(SavedErr, STDERR_FILENO);
+		for (int Fd : {SavedOut, SavedErr, Fds[0], Fds[1]}) {
+			close(Fd);
+		}
+
+		if (write(Client, &Result, sizeof(Result)) != sizeof(Result)) {
+			llvm::errs() << "Could not reply to client\n";
+		}
+	}
+
+	int runRequest(ArrayRef<StringRef> Args) {
+		std::vector<std::string> Storage(Args.begin(), Args.end());
+		std::vector<const char *> Argv;
+		for (const auto &Arg : Storage) {
+			Argv.push_back(Arg.c_str());
+		}
+		int Argc = Argv.size();
+
+		// CommonOptionsParser resets all options before parsing
+		auto ExpectedParser = tooling::CommonOptionsParser::create(
+			Argc, Argv.data(), MyToolCategory);
+		if (!ExpectedParser) {
+			llvm::errs() << ExpectedParser.takeError();
+			return 1;
+		}
+
+		SmallString<256> Cwd;
+		llvm::sys::fs::current_path(Cwd);
+		if (!Files || Cwd != FilesCwd || isStale()) {
+			Files = new FileManager(FileSystemOptions());
+			FilesCwd = Cwd.str().str();
+		}
+
+		int Result = 1;
+		try {
+			Result = run(ExpectedParser.get(), "enum_to_string",
+						 {{"enumRule", makeEnumRule(), OutOfLine, {"enum"}}},
+						 Files);
+		} catch (const std::exception &E) {
+			llvm::errs() << E.what();
+		}
+		recordStamps();
+		return Result;
+	}
+
+	/// Whether a file seen by the FileManager changed since the last request
+	bool isStale() const {
+		for (const auto &[File, Stamp] : Stamps) {
+			if (tool_support::getFileStamp(File) != Stamp) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Remember the state of all files seen by the FileManager. Drops the
+	/// FileManager if a file already differs from what it has cached, e.g.
+	/// because the request rewrote it.
+	void recordStamps() {
+		Stamps.clear();
+		SmallVector<const FileEntry *> Entries;
+		Files->GetUniqueIDMapping(Entries);
+		for (const auto *Entry : Entries) {
+			if (!Entry) {
+				continue;
+			}
+			llvm::sys::fs::file_status Status;
+			if (llvm::sys::fs::status(Entry->getName(), Status) ||
+				Status.getSize() != uint64_t(Entry->getSize()) ||
+				llvm::sys::toTimeT(Status.getLastModificationTime()) !=
+					Entry->getModificationTime()) {
+				Files = nullptr;
+				Stamps.clear();
+				return;
+			}
+			Stamps.emplace_back(Entry->getName().str(),
+								tool_support::getFileStamp(Entry->getName()));
+		}
+	}
+
+	static bool readAll(int Fd, char *Data, size_t Size) {
+		while (Size > 0) {
+			auto Read = read(Fd, Data, Size);
+			if (Read <= 0) {
+				if (Read < 0 && errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			Data += Read;
+			Size -= Read;
+		}
+		return true;
+	}
+
+	std::string SocketPath;
+	IntrusiveRefCntPtr<FileManager> Files;
+	std::string FilesCwd;
+	std::vector<std::pair<std::string, std::string>> Stamps;
+};
+
+// The benchmarks include this file for its matchers and stencils
+#ifndef ENUM_TO_STRING_NO_MAIN
+int main(int argc, const char **argv) {
+	// The server takes no source files, so it is started before the normal
+	// option parsing, which requires at least one
+	for (int I = 1; I < argc; ++I) {
+		StringRef Arg(argv[I]);
+		if (Arg.consume_front("-serve=") || Arg.consume_front("--serve=")) {
+			return ToolServer(Arg).serve();
+		}
+		if (Arg == "-serve" || Arg == "--serve") {
+			auto SocketPath = socket_path::getDefaultSocketPath(true);
+			if (SocketPath.empty()) {
+				llvm::errs() << "No private directory for the socket, pass "
+								"--serve=<socket>\n";
+				return 1;
+			}
+			return ToolServer(SocketPath).serve();
+		}
+	}
+	// Neither does the merge step of --shard
+	for (int I = 1; I < argc; ++I) {
+		StringRef Arg(argv[I]);
+		if (Arg.startswith("-merge=") || Arg.startswith("--merge=")) {
+			if (!llvm::cl::ParseCommandLineOptions(argc, argv, "",
+												   &llvm::errs())) {
+				return 1;
+			}
+			return mergeAndApply(MergeFiles);
+		}
+	}
+
+	// Configuring the command-line options
+	auto ExpectedParser =
+		clang::tooling::CommonOptionsParser::create(argc, argv, MyToolCategory);
+	if (!ExpectedParser) {
+		// Fail gracefully for unsupported options.
+		llvm::errs() << ExpectedParser.takeError();
+		return 1;
+	}
+
+	return run(ExpectedParser.get(), "enum_to_string",
+			   {{"enumRule", makeEnumRule(), OutOfLine, {"enum"}}});
 }
+#endif
@@ -0,0 +1,214 @@
+// Microbenchmarks of the matchers, stencils and change application of
+// enum_to_string, on ASTs built in memory. Unlike time.sh, a regression in a
+// single component shows up here on its own.
+#define ENUM_TO_STRING_NO_MAIN
+#include "enum_to_string.cpp"
+
+#include "clang/Tooling/Tooling.h"
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+
+/// N enums with eight constants each, three namespaces deep. Each enum is used
+/// by a variable through its qualified name.
+static std::string generateEnums(int64_t N) {
+	std::string Code;
+	for (int64_t I = 0; I < N; ++I) {
+		auto Name = "E" + std::to_string(I);
+		Code += "namespace a { namespace b { namespace c {\n"
+				"enum class " +
+				Name +
+				" { V0, V1, V2, V3, V4, V5, V6, V7 };\n"
+				"} } }\n"
+				"a::b::c::" +
+				Name + " v" + std::to_string(I) + ";\n";
+	}
+	return Code;
+}
+
+static std::unique_ptr<ASTUnit> buildEnums(int64_t N) {
+	return tooling::buildASTFromCodeWithArgs(generateEnums(N), {"-std=c++17"});
+}
+
+/// Run Matcher over the whole AST. Compare with the baseline benchmarks to get
+/// the cost of the matcher itself.
+template <typename MatcherT>
+static void matchAll(benchmark::State &State, const MatcherT &Matcher) {
+	auto AST = buildEnums(State.range(0));
+	for (auto _ : State) {
+		benchmark::DoNotOptimize(match(Matcher, AST->getASTContext()));
+	}
+	State.SetItemsProcessed(State.iterations() * State.range(0));
+}
+
+/// Evaluate Stencil on every enum, bound to "enumDecl" like in the enum rule
+static void evalAll(benchmark::State &State, const NodeOps::resType &Stencil) {
+	auto AST = buildEnums(State.range(0));
+	auto &Context = AST->getASTContext();
+	auto Matches = match(enumDecl().bind("enumDecl"), Context);
+
+	for (auto _ : State) {
+		for (const auto &Nodes : Matches) {
+			auto Text =
+				Stencil(ast_matchers::MatchFinder::MatchResult(Nodes, &Context));
+			if (!Text) {
+				llvm::consumeError(Text.takeError());
+				State.SkipWithError("Stencil failed");
+				return;
+			}
+			benchmark::DoNotOptimize(*Text);
+		}
+	}
+	State.SetItemsProcessed(State.iterations() * Matches.size());
+}
+
+static void BM_enumDecl_baseline(benchmark::State &State) {
+	matchAll(State, enumDecl());
+}
+BENCHMARK(BM_enumDecl_baseline)->Arg(100)->Arg(10000);
+
+static void BM_has_rec_decl_context(benchmark::State &State) {
+	matchAll(State,
+			 enumDecl(matchers::has_rec_decl_context(translationUnitDecl())));
+}
+BENCHMARK(BM_has_rec_decl_context)->Arg(100)->Arg(10000);
+
+static void BM_nestedNameSpecifier_baseline(benchmark::State &State) {
+	matchAll(State, nestedNameSpecifier());
+}
+BENCHMARK(BM_nestedNameSpecifier_baseline)->Arg(100)->Arg(10000);
+
+static void BM_rec_specifies_namespace(benchmark::State &State) {
+	matchAll(State, nestedNameSpecifier(matchers::rec_specifies_namespace(
+						namespaceDecl(hasName("a")))));
+}
+BENCHMARK(BM_rec_specifies_namespace)->Arg(100)->Arg(10000);
+
+static void BM_foreach_enum_const(benchmark::State &State) {
+	evalAll(State,
+			NodeOps::foreach_enum_const(
+				"enumDecl", [](const ast_matchers::MatchFinder::MatchResult &,
+							   const EnumConstantDecl *enum_const_decl) {
+					return enum_const_decl->getNameAsString();
+				}));
+}
+BENCHMARK(BM_foreach_enum_const)->Arg(100)->Arg(10000);
+
+static void BM_case_enum_to_string(benchmark::State &State) {
+	evalAll(State, NodeOps::case_enum_to_string(
+					   "enumDecl", transformer::cat(transformer::name("enumDecl"))));
+}
+BENCHMARK(BM_case_enum_to_string)->Arg(100)->Arg(10000);
+
+static void BM_switch_enum_to_string(benchmark::State &State) {
+	evalAll(State, NodeOps::switch_enum_to_string(
+					   "enumDecl", transformer::cat(transformer::name("enumDecl"))));
+}
+BENCHMARK(BM_switch_enum_to_string)->Arg(100)->Arg(10000);
+
+/// The enums are contiguous, so this is the table indexed by the value
+static void BM_table_enum_to_string(benchmark::State &State) {
+	evalAll(State, NodeOps::table_enum_to_string(
+					   "enumDecl", transformer::cat(transformer::name("enumDecl")),
+					   0.5));
+}
+BENCHMARK(BM_table_enum_to_string)->Arg(100)->Arg(10000);
+
+/// No enum can be denser than 1, so this is the sorted table
+static void BM_sorted_table_enum_to_string(benchmark::State &State) {
+	evalAll(State, NodeOps::table_enum_to_string(
+					   "enumDecl", transformer::cat(transformer::name("enumDecl")),
+					   2));
+}
+BENCHMARK(BM_sorted_table_enum_to_string)->Arg(100)->Arg(10000);
+
+/// Includes computing the perfect hash of the names
+static void BM_hash_enum_from_string(benchmark::State &State) {
+	evalAll(State, NodeOps::hash_enum_from_string(
+					   "enumDecl", transformer::cat(transformer::name("enumDecl"))));
+}
+BENCHMARK(BM_hash_enum_from_string)->Arg(100)->Arg(10000);
+
+/// Scan N lines of code without enums, comments and literals included, so
+/// the prefilter has to go through all of it
+static void BM_prefilter(benchmark::State &State) {
+	std::string Code;
+	for (int64_t I = 0; I < State.range(0); ++I) {
+		auto Name = "v" + std::to_string(I);
+		Code += "int " + Name + "[4] = {1, 2, 3, 4}; // the entries of " +
+				Name + "\nconst char *" + Name + "_name = \"" + Name +
+				"\";\n";
+	}
+
+	token_prefilter::TokenPrefilter Filter({"enum"});
+	for (auto _ : State) {
+		benchmark::DoNotOptimize(Filter.mayMatch(Code));
+	}
+	State.SetBytesProcessed(State.iterations() * Code.size());
+}
+BENCHMARK(BM_prefilter)->Arg(100)->Arg(100000);
+
+static bool writeFile(StringRef Path, StringRef Content) {
+	std::error_code EC;
+	llvm::raw_fd_ostream Out(Path, EC);
+	Out << Content;
+	return !EC;
+}
+
+/// Apply one change after every line of a file with N lines, in place
+static void BM_applyAllChanges(benchmark::State &State) {
+	SmallString<128> File;
+	if (llvm::sys::fs::createTemporaryFile("enum_to_string_benchmark", "cpp",
+										   File)) {
+		State.SkipWithError("Could not create a temporary file");
+		return;
+	}
+
+	std::string Code;
+	for (int64_t I = 0; I < State.range(0); ++I) {
+		Code += "enum class E" + std::to_string(I) + " { A, B };\n";
+	}
+
+	tooling::FixedCompilationDatabase Compilations(".", {});
+	EnumStringGeneratorTool Tool(Compilations, {});
+	SourceManagerForFile Sources(File, Code);
+	auto &SM = Sources.get();
+	auto Start = SM.getLocForStartOfFile(SM.getMainFileID());
+	for (size_t Offset = Code.find('\n'); Offset != std::string::npos;
+		 Offset = Code.find('\n', Offset + 1)) {
+		auto Loc = Start.getLocWithOffset(Offset + 1);
+		tooling::AtomicChange Change(SM, Loc);
+		if (auto Err = Change.insert(SM, Loc, "// to_string\n")) {
+			llvm::consumeError(std::move(Err));
+			State.SkipWithError("Could not create the changes");
+			return;
+		}
+		Tool.getChanges().add(std::move(Change));
+	}
+
+	// applyAllChanges reports the time spent writing on stderr
+	int Stderr = dup(STDERR_FILENO);
+	int Null = open("/dev/null", O_WRONLY);
+	dup2(Null, STDERR_FILENO);
+	close(Null);
+
+	Inplace = true;
+	for (auto _ : State) {
+		State.PauseTiming();
+		bool Written = writeFile(File, Code);
+		State.ResumeTiming();
+		if (!Written || !Tool.applyAllChanges()) {
+			State.SkipWithError("Could not apply the changes");
+			break;
+		}
+	}
+	Inplace = false;
+
+	dup2(Stderr, STDERR_FILENO);
+	close(Stderr);
+	llvm::sys::fs::remove(File);
+	State.SetItemsProcessed(State.iterations() * State.range(0));
+}
+BENCHMARK(BM_applyAllChanges)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,139 @@
+// Thin client for `enum_to_string --serve=<socket>`.
+//
+// Takes the same arguments as enum_to_string and forwards them to the server,
+// together with the working directory and the client's stdout and stderr, so
+// the output of the server ends up exactly where the output of the tool
+// would. See ToolServer in enum_to_string.cpp for the protocol.
+//
+// The socket is taken from $ENUM_TO_STRING_SOCKET, and defaults to the one of
+// `enum_to_string --serve`, see socket_path.h. If no server is running, or the
+// arguments ask for e.g. --help, the enum_to_string binary next to the client
+// is run instead.
+//
+// Deliberately does not link against LLVM, so starting it is cheap.
+#include "socket_path.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+/// Options that make the tool print something and exit while parsing. The
+/// server must never see these.
+static bool isLocalOnly(const std::string &arg) {
+	for (const char *prefix : {"-help", "--help", "-version", "--version"}) {
+		if (arg.rfind(prefix, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/// Replace the client with the enum_to_string binary next to it
+static int runLocally(const char **argv) {
+	std::string self = argv[0];
+	auto dir_end = self.find_last_of('/');
+	std::string tool = (dir_end == std::string::npos
+	                        ? std::string()
+	                        : self.substr(0, dir_end + 1)) +
+	                   "enum_to_string";
+	execv(tool.c_str(), const_cast<char *const *>(argv));
+	std::cerr << "Could not run " << tool << ": " << std::strerror(errno)
+	          << "\n";
+	return 1;
+}
+
+static int connectToServer() {
+	std::string path;
+	if (const char *env = std::getenv("ENUM_TO_STRING_SOCKET")) {
+		path = env;
+	} else {
+		path = socket_path::getDefaultSocketPath(false);
+	}
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	std::strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 &&
+	    connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		auto written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+int main(int argc, const char **argv) {
+	for (int i = 1; i < argc; ++i) {
+		if (isLocalOnly(argv[i])) {
+			return runLocally(argv);
+		}
+	}
+
+	int server = connectToServer();
+	if (server < 0) {
+		return runLocally(argv);
+	}
+
+	// Payload: working directory and arguments, each terminated by '\0'
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		std::cerr << "Could not get the working directory\n";
+		return 1;
+	}
+	std::string payload = std::string(cwd) + '\0';
+	for (int i = 0; i < argc; ++i) {
+		payload += std::string(argv[i]) + '\0';
+	}
+
+	// Header: our stdout and stderr, and the size of the payload
+	uint32_t size = payload.size();
+	iovec iov{&size, sizeof(size)};
+	alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	auto *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+	std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int result = 1;
+	if (sendmsg(server, &msg, 0) != sizeof(size) ||
+	    !writeAll(server, payload.data(), payload.size()) ||
+	    read(server, &result, sizeof(result)) != sizeof(result)) {
+		std::cerr << "Lost connection to the enum_to_string server\n";
+		return 1;
+	}
+	close(server);
+	return result;
+}
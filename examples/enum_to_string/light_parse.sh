@@ -0,0 +1,53 @@
+#!/bin/bash
+# Compares a normal parse with --light_parse on a file including template heavy
+# headers. The tool must be built in the `build` folder.
+# Fails if the generated code differs.
+RUNS=${1:-10}
+TOOL=./build/bin/enum_to_string
+INPUT=$(mktemp --suffix=.cpp)
+trap 'rm -f "$INPUT"' EXIT
+
+cat > "$INPUT" << 'CPP'
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <regex>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+enum class Color { Red, Green, Blue };
+
+namespace shapes {
+enum Shape { Circle, Square };
+}
+
+int count(const std::vector<std::string> &words) {
+	std::map<std::string, int> counts;
+	for (const auto &word : words) {
+		if (std::regex_match(word, std::regex("[a-z]+"))) {
+			++counts[word];
+		}
+	}
+	enum Local { A, B };
+	return std::count_if(counts.begin(), counts.end(),
+	                     [](const auto &entry) { return entry.second > 1; });
+}
+CPP
+
+bench() {
+	local start=$(date +%s%N)
+	for i in $(seq $RUNS); do $TOOL "$@" "$INPUT" -- > /dev/null; done
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+full=$(bench)
+light=$(bench --light_parse)
+echo "Full parse: ${full}ms, light parse: ${light}ms ($RUNS runs)"
+
+cmp -s <($TOOL "$INPUT" --) <($TOOL --light_parse "$INPUT" --) || {
+	echo "The output of --light_parse differs"
+	exit 1
+}
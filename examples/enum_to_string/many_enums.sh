@@ -0,0 +1,14 @@
+#!/bin/bash
+# Times the tool on a generated file with one change per enum, 100k by
+# default. Mostly measures collecting and applying the changes.
+# The tool must be built in the `build` folder.
+COUNT=${1:-100000}
+TOOL=${TOOL:-./build/bin/enum_to_string}
+INPUT=$(mktemp --suffix=.cpp)
+trap 'rm -f "$INPUT"' EXIT
+
+for i in $(seq $COUNT); do echo "enum class E$i { A, B };"; done > "$INPUT"
+
+start=$(date +%s%N)
+$TOOL "$INPUT" -- > /dev/null || exit 1
+echo "$COUNT changes: $(( ($(date +%s%N) - start) / 1000000 ))ms"
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Two-stage PGO build of enum_to_string, with static libraries and ThinLTO.
+# Builds an instrumented tool in build-pgo, trains it on the files in
+# pgo_corpus and on a generated file with many enums, and builds the optimized
+# tool in `build` with the merged profile.
+# LLVM_BUILD must be set, and contain llvm-profdata.
+set -e
+: "${LLVM_BUILD:?Set LLVM_BUILD to the LLVM build folder}"
+COUNT=${1:-10000}
+STAGE1=build-pgo
+PROFILE=$PWD/$STAGE1/enum_to_string.profdata
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cmake -S . -B $STAGE1 -G Ninja -DCMAKE_BUILD_TYPE=Release -DSTATIC_LTO=ON \
+	-DPGO=GENERATE
+cmake --build $STAGE1 --target enum_to_string
+
+cp input_file.orig.cpp pgo_corpus/*.cpp "$WORK"
+for i in $(seq $COUNT); do echo "enum class E$i { A, B };"; done > "$WORK/many.cpp"
+
+export LLVM_PROFILE_FILE="$WORK/profiles/%p.profraw"
+for file in "$WORK"/*.cpp; do
+	$STAGE1/bin/enum_to_string "$file" -- -std=c++17 > /dev/null
+	$STAGE1/bin/enum_to_string --light_parse "$file" -- -std=c++17 > /dev/null
+done
+$STAGE1/bin/enum_to_string -j 4 --in_place "$WORK"/*.cpp -- -std=c++17
+
+"$LLVM_BUILD/bin/llvm-profdata" merge -o "$PROFILE" "$WORK/profiles"
+
+cmake -S . -B build -G Ninja -DCMAKE_BUILD_TYPE=Release -DSTATIC_LTO=ON \
+	-DPGO=USE -DPGO_PROFILE="$PROFILE"
+cmake --build build --target enum_to_string
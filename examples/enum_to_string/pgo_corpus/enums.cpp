@@ -0,0 +1,36 @@
+// Training input for pgo.sh: enums in the places the tool looks for them
+#include <cstdint>
+#include <string_view>
+
+enum Plain { First, Second, Third };
+
+enum class Scoped : std::uint8_t { Low = 1, Mid = 2, High = 4 };
+
+enum class Sparse { A = 1, B = 10, C = 100, D = 1000, E = 10000 };
+
+namespace net {
+enum class Protocol { Tcp, Udp, Icmp, Sctp };
+
+namespace http {
+enum class Method { Get, Head, Post, Put, Delete, Connect, Options, Trace };
+enum Status { Ok = 200, Created = 201, NotFound = 404, Teapot = 418 };
+} // namespace http
+} // namespace net
+
+namespace {
+enum class Hidden { Yes, No };
+}
+
+struct Widget {
+	enum class State { Idle, Busy };
+	State state;
+};
+
+constexpr int to_string(net::Protocol e) {
+	return 0;
+}
+
+int use(net::http::Method m) {
+	enum Local { X, Y };
+	return static_cast<int>(m) + Y;
+}
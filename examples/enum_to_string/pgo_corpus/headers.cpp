@@ -0,0 +1,20 @@
+// Training input for pgo.sh: few enums behind template heavy headers, which
+// is where most of the time goes for typical translation units
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace config {
+enum class Level { Debug, Info, Warning, Error, Fatal };
+enum Source { File, Environment, CommandLine };
+} // namespace config
+
+std::map<std::string, config::Level> levels(const std::vector<std::string> &names) {
+	std::map<std::string, config::Level> result;
+	for (const auto &name : names) {
+		result[name] = config::Level::Info;
+	}
+	return result;
+}
@@ -0,0 +1,46 @@
+// Default socket of `enum_to_string --serve`, shared by the server and
+// enum_to_string_client. Does not use LLVM, as the client does not link it.
+//
+// The socket lives in $XDG_RUNTIME_DIR, or else in /tmp/enum_to_string-<uid>.
+// Either directory must belong to the user and be closed to everyone else, so
+// no other user can connect to the server, or pose as it to the client.
+#ifndef ENUM_TO_STRING_SOCKET_PATH_H
+#define ENUM_TO_STRING_SOCKET_PATH_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+namespace socket_path {
+
+/// Whether Dir is a directory of the current user that no one else can
+/// access. With Create, a missing Dir is created first.
+inline bool isPrivateDirectory(const std::string &Dir, bool Create) {
+	if (Create && mkdir(Dir.c_str(), 0700) && errno != EEXIST) {
+		return false;
+	}
+	struct stat Status;
+	return lstat(Dir.c_str(), &Status) == 0 && S_ISDIR(Status.st_mode) &&
+		   Status.st_uid == getuid() && (Status.st_mode & 077) == 0;
+}
+
+/// The default socket, see above. With Create, the directory in /tmp is
+/// created if missing. Empty if the directory is missing or not private.
+inline std::string getDefaultSocketPath(bool Create) {
+	const char *RuntimeDir = std::getenv("XDG_RUNTIME_DIR");
+	if (RuntimeDir && *RuntimeDir && isPrivateDirectory(RuntimeDir, false)) {
+		return std::string(RuntimeDir) + "/enum_to_string.sock";
+	}
+	auto Dir = "/tmp/enum_to_string-" + std::to_string(getuid());
+	if (!isPrivateDirectory(Dir, Create)) {
+		return "";
+	}
+	return Dir + "/enum_to_string.sock";
+}
+
+} // namespace socket_path
+
+#endif
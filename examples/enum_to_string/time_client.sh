@@ -0,0 +1,10 @@
+#!/bin/bash
+# Same as time.sh, but through a server that stays warm between invocations.
+# The socket is in a fresh directory only the user can access.
+SOCKET_DIR=$(mktemp -d)
+export ENUM_TO_STRING_SOCKET=$SOCKET_DIR/enum_to_string.sock
+./build/bin/enum_to_string --serve=$ENUM_TO_STRING_SOCKET &
+SERVER=$!
+trap "kill $SERVER; rm -rf $SOCKET_DIR" EXIT
+while [ ! -S $ENUM_TO_STRING_SOCKET ]; do sleep 0.1; done
+time for i in {1..100}; do ./build/bin/enum_to_string_client input_file.cpp --; done
@@ -0,0 +1,59 @@
+#!/bin/bash
+# Compares the generated to_string as a switch and as tables (see
+# --to_string_table) on a contiguous enum and a sparse enum with COUNT
+# enumerators, 500 by default. Reports the time to compile the generated code
+# with -O2, and the time to call to_string on every value 100000 times.
+# The tool must be built in the `build` folder.
+COUNT=${1:-500}
+CXX=${CXX:-clang++}
+TOOL=./build/bin/enum_to_string
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+{
+	echo "enum class Dense {"
+	for i in $(seq 0 $((COUNT - 1))); do echo "	D$i,"; done
+	echo "};"
+	echo "enum class Sparse {"
+	for i in $(seq 0 $((COUNT - 1))); do echo "	S$i = $((i * i * 7)),"; done
+	echo "};"
+} > "$WORK/input.cpp"
+
+cat > "$WORK/main.cpp" << CPP
+#include <chrono>
+#include <cstdio>
+#include "generated.cpp"
+
+// Only calls with the values of the enumerators, since the switch has no
+// default: i for Dense, and i * i * 7 for Sparse
+template <typename E> long long callAll(int scale) {
+	long long length = 0;
+	for (int run = 0; run < 100000; ++run) {
+		for (int i = 0; i < $COUNT; ++i) {
+			length += to_string(static_cast<E>(scale ? i * i * scale : i)).size();
+		}
+	}
+	return length;
+}
+
+int main() {
+	auto start = std::chrono::steady_clock::now();
+	auto length = callAll<Dense>(0) + callAll<Sparse>(7);
+	auto end = std::chrono::steady_clock::now();
+	std::printf("%lldms (%lld)\n",
+	            static_cast<long long>(std::chrono::duration_cast<
+	                std::chrono::milliseconds>(end - start).count()),
+	            length);
+}
+CPP
+
+bench() {
+	$TOOL "$@" "$WORK/input.cpp" -- -std=c++17 > "$WORK/generated.cpp" || exit 1
+	local start=$(date +%s%N)
+	$CXX -std=c++17 -O2 "$WORK/main.cpp" -o "$WORK/main" || exit 1
+	local compile=$(( ($(date +%s%N) - start) / 1000000 ))
+	echo "compile ${compile}ms, run $("$WORK/main")"
+}
+
+echo "Switch: $(bench)"
+echo "Table: $(bench --to_string_table)"
@@ -38,6 +38,31 @@ static llvm::cl::opt<bool> DebugMsgs(
     "debug_info", llvm::cl::desc("Print debug information to cout."),
     llvm::cl::cat(MyToolCategory));
 
+/// Changes grouped by the file they apply to. Changes are moved into the
+/// bucket of their file as they are produced, and applied from there.
+class ChangeSet {
+   public:
+	/// Number of changes a new bucket holds before it has to grow
+	static constexpr size_t InitialBucketSize = 256;
+
+	void add(tooling::AtomicChange &&Change) {
+		auto [It, Inserted] = Files.try_emplace(Change.getFilePath());
+		if (Inserted) {
+			It->second.reserve(InitialBucketSize);
+		}
+		It->second.push_back(std::move(Change));
+	}
+
+	/// Iterate the buckets in order of their file names
+	auto begin() { return Files.begin(); }
+	auto end() { return Files.end(); }
+	auto begin() const { return Files.begin(); }
+	auto end() const { return Files.end(); }
+
+   private:
+	std::map<std::string, tooling::AtomicChanges> Files;
+};
+
 struct EnumStringGeneratorTool : public tooling::ClangTool {
 	EnumStringGeneratorTool(
 	    const tooling::CompilationDatabase &Compilations,
@@ -47,7 +72,7 @@ struct EnumStringGeneratorTool : public tooling::ClangTool {
 	    : ClangTool(Compilations, SourcePaths, std::move(PCHContainerOps)) {}
 
 	/// Return a reference to the current changes
-	tooling::AtomicChanges &getChanges() { return Changes; }
+	ChangeSet &getChanges() { return Changes; }
 
 	/// Call run(), apply all generated replacements, and immediately save
 	/// the results to disk.
@@ -83,13 +108,8 @@ struct EnumStringGeneratorTool : public tooling::ClangTool {
 		tooling::ApplyChangesSpec Spec;
 		Spec.Style = format::getLLVMStyle();
 
-		// Split the changes according to filename
-		std::map<std::string, tooling::AtomicChanges> Files;
-		for (const auto &Change : Changes)
-			Files[Change.getFilePath()].push_back(Change);
-
 		// Apply all atomic changes to all files
-		for (const auto &[File, FileChanges] : Files) {
+		for (const auto &[File, FileChanges] : Changes) {
 			// Get File from file manager
 			auto Entry = fm.getFileRef(File);
 			if (!Entry) {
@@ -125,11 +145,11 @@ struct EnumStringGeneratorTool : public tooling::ClangTool {
 	}
 
    private:
-	tooling::AtomicChanges Changes{};
+	ChangeSet Changes{};
 };
 
 struct MyConsumer {
-	explicit MyConsumer(tooling::AtomicChanges &Changes) : Changes(Changes) {}
+	explicit MyConsumer(ChangeSet &Changes) : Changes(Changes) {}
 
 	auto RefactorConsumer() {
 		return [this](Expected<tooling::TransformerResult<std::string>> C) {
@@ -144,13 +164,14 @@ struct MyConsumer {
 			}
 
 			// Save the changes to be handled later
-			Changes.insert(Changes.begin(), C.get().Changes.begin(),
-			               C.get().Changes.end());
+			for (auto &Change : C.get().Changes) {
+				Changes.add(std::move(Change));
+			}
 		};
 	}
 
    private:
-	tooling::AtomicChanges &Changes;
+	ChangeSet &Changes;
 };
 
 /// Stencil for retrieving extra information of a node
@@ -241,8 +262,60 @@ AST_MATCHER(NamedDecl, is_named) {
 	return Node.getIdentifier();   // nullptr if no name
 }
 
+/// Like `hasAnyName` with fully qualified names, but the names are read when
+/// matching instead of when the matcher is created. This allows an earlier
+/// phase on the same AST to fill the collection.
+AST_MATCHER_P(NamedDecl, has_name_in, const std::vector<std::string> *,
+              names) {
+	return llvm::is_contained(*names, "::" + Node.getQualifiedNameAsString());
+}
+
 }	// namespace matchers
 
+/// ASTConsumer factory that runs several MatchFinders, one phase after the
+/// other, over the same ASTContext. Each translation unit is thereby only
+/// parsed once, and its AST is freed as soon as the last phase has run.
+struct MultiPhaseMatcher {
+	explicit MultiPhaseMatcher(std::vector<ast_matchers::MatchFinder *> phases)
+	    : phases(std::move(phases)) {}
+
+	std::unique_ptr<ASTConsumer> newASTConsumer() {
+		return std::make_unique<Consumer>(phases);
+	}
+
+   private:
+	struct Consumer : public ASTConsumer {
+		explicit Consumer(ArrayRef<ast_matchers::MatchFinder *> phases)
+		    : phases(phases) {}
+
+		void HandleTranslationUnit(ASTContext &Context) override {
+			for (auto *phase : phases) {
+				phase->matchAST(Context);
+			}
+		}
+
+		ArrayRef<ast_matchers::MatchFinder *> phases;
+	};
+
+	std::vector<ast_matchers::MatchFinder *> phases;
+};
+
+/// Clears the collection from the first phase before each translation unit.
+/// The collection only describes enums in the main file of the current
+/// translation unit.
+struct ClearCollectionCallbacks : public tooling::SourceFileCallbacks {
+	explicit ClearCollectionCallbacks(std::vector<std::string> &collection)
+	    : collection(collection) {}
+
+	bool handleBeginSource(CompilerInstance &CI) override {
+		collection.clear();
+		return true;
+	}
+
+   private:
+	std::vector<std::string> &collection;
+};
+
 int main(int argc, const char **argv) {
 	// Configuring the command-line options
 
@@ -264,24 +337,6 @@ int main(int argc, const char **argv) {
 	MyConsumer consumer(tool.getChanges());
 	auto transformer_consumer = consumer.RefactorConsumer();
 
-	// Helper method for invoking a rule using the tool
-	auto runToolWithRule = [&](auto rule, bool save = false) {
-		ast_matchers::MatchFinder finder;
-
-		tooling::Transformer transformer{rule, transformer_consumer};
-		transformer.registerMatchers(&finder);
-
-		// Run the tool and save the changes on disk immediately.
-		// See clang/tools/clang-rename/ClangRename.cpp:190-237 for other
-		// options
-		if (not save) {
-			return tool.run(tooling::newFrontendActionFactory(&finder).get());
-		} else {
-			return tool.runAndSave(
-			    tooling::newFrontendActionFactory(&finder).get());
-		}
-	};
-
 	// Binding names
 	auto enum_decl = "enumDecl";
 	auto to_string_method = "to_string";
@@ -322,25 +377,13 @@ int main(int argc, const char **argv) {
 	                 enum_decl, &enum_names))))},
 	    transformer::cat("Updating existing ", to_string_method, " method"));
 
-	// Update existing to_string methods with enum parameters
-	runToolWithRule(rule_existing_to_string_method);
-
-	// Format enum_names into StringRefs
-	std::vector<StringRef> enum_tmp;
-	for (std::string &e : enum_names) {
-		enum_tmp.emplace_back(StringRef(e));
-	}
-
-	ArrayRef<StringRef> enums(enum_tmp);
-
-	// Matcher of enums that have no existing to_string method. This must be
-	// declared bellow the execution of the first rule, as the `enums` variable
-	// must contain the valid names when this rule is created.
+	// Matcher of enums that have no existing to_string method. The first rule
+	// must have run on the translation unit before this matcher, as
+	// `enum_names` must contain the valid names when it is matched.
 	auto find_other_enums =
 	    ast_matchers::enumDecl(
-	        ast_matchers::isExpansionInMainFile(),
-			matchers::is_named(),
-	        ast_matchers::unless(ast_matchers::hasAnyName(enums)))
+	        ast_matchers::isExpansionInMainFile(), matchers::is_named(),
+	        ast_matchers::unless(matchers::has_name_in(&enum_names)))
 	        .bind(enum_decl);
 
 	// Rule to update the rest of the enums
@@ -360,6 +403,22 @@ int main(int argc, const char **argv) {
 	                          "\t}\n}"))},
 	    transformer::cat("Adding new ", to_string_method, " method"));
 
-	// Run the second rule
-	return runToolWithRule(rule_other_enums, true);
+	// Phase 1 updates existing to_string methods with enum parameters. Phase 2
+	// adds to_string methods to the rest of the enums.
+	ast_matchers::MatchFinder existing_finder;
+	tooling::Transformer existing_transformer{rule_existing_to_string_method,
+	                                          transformer_consumer};
+	existing_transformer.registerMatchers(&existing_finder);
+
+	ast_matchers::MatchFinder other_finder;
+	tooling::Transformer other_transformer{rule_other_enums,
+	                                       transformer_consumer};
+	other_transformer.registerMatchers(&other_finder);
+
+	// Run both phases on each AST and save the changes on disk immediately.
+	// See clang/tools/clang-rename/ClangRename.cpp:190-237 for other options
+	MultiPhaseMatcher phases({&existing_finder, &other_finder});
+	ClearCollectionCallbacks callbacks(enum_names);
+	return tool.runAndSave(
+	    tooling::newFrontendActionFactory(&phases, &callbacks).get());
 }
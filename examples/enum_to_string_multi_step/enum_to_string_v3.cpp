@@ -1,6 +1,7 @@
 // Declares clang::SyntaxOnlyAction.
 #include "clang/ASTMatchers/ASTMatchersMacros.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Index/USRGeneration.h"
 #include "clang/Rewrite/Core/Rewriter.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Refactoring.h"
@@ -9,11 +10,19 @@
 #include "clang/Tooling/Transformer/Stencil.h"
 #include "clang/Tooling/Transformer/Transformer.h"
 // Declares llvm::cl::extrahelp.
+#include <array>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <sstream>
+#include <vector>
 
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/xxhash.h"
 
 using namespace clang;
 
@@ -34,6 +43,11 @@ static llvm::cl::opt<bool> Inplace(
     llvm::cl::desc("Inplace edit <file>s, if specified. If not specified the "
                    "generated code will be printed to cout."),
     llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> PrintIndex(
+    "print_index",
+    llvm::cl::desc("Print the qualified names of the enums with an existing "
+                   "to_string method, found by the first phase, to stderr."),
+    llvm::cl::cat(MyToolCategory));
 
 struct EnumStringGeneratorTool : public tooling::ClangTool {
 	EnumStringGeneratorTool(
@@ -154,7 +168,179 @@ struct transform_info {
 	CharSourceRange start;
 };
 
-std::unordered_map<std::string, transform_info> enums;
+/// The existing to_string methods found by the first phase, keyed by the USR
+/// of their enum. The USR is the same whether the enum is reached through a
+/// parameter type or its declaration, and in every translation unit.
+///
+/// Readers and writers may run concurrently. The entries are spread over
+/// shards with a lock each, so threads working on different enums rarely
+/// wait for each other.
+///
+/// The ranges are stored as offsets in their file, and only turned back into
+/// source locations when read. They are thereby valid in any parse of the
+/// file, not only in the one that stored them.
+class EnumIndex {
+   public:
+	/// Store the ranges of the existing to_string method of Enum
+	void insert(const EnumDecl *Enum, const transform_info &Info,
+	            const SourceManager &SM) {
+		auto usr = getUSR(Enum);
+		if (usr.empty()) {
+			return;
+		}
+		// The method and its parameter are in the same file
+		auto file = SM.getFileEntryRefForID(
+		    SM.getFileID(SM.getFileLoc(Info.type.getBegin())));
+		if (!file) {
+			return;
+		}
+		Entry entry{getFileId(file->getName()), compact(Info.type, SM),
+		            compact(Info.start, SM)};
+
+		auto &shard = getShard(usr);
+		std::unique_lock lock(shard.mutex);
+		shard.entries[usr] = entry;
+		shard.names[usr] = Enum->getQualifiedNameAsString();
+	}
+
+	/// A CharSourceRange as offsets in its file
+	struct Range {
+		uint32_t begin;
+		uint32_t end : 31;
+		uint32_t is_token_range : 1;
+	};
+
+	/// What is stored for an enum, independent of any SourceManager
+	struct Entry {
+		uint32_t file;
+		Range type;
+		Range start;
+	};
+
+	/// The entry stored for Enum, if any
+	std::optional<Entry> find(const EnumDecl *Enum) const {
+		auto usr = getUSR(Enum);
+		if (usr.empty()) {
+			return std::nullopt;
+		}
+
+		const auto &shard = getShard(usr);
+		std::shared_lock lock(shard.mutex);
+		auto it = shard.entries.find(usr);
+		if (it == shard.entries.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	/// Name of the file of an entry
+	StringRef getFileName(const Entry &entry) const {
+		std::shared_lock lock(files_mutex);
+		return files[entry.file];
+	}
+
+	/// The ranges stored for Enum, as locations of SM. Empty if nothing was
+	/// stored, or the file of the ranges is not part of SM. Unlike the index,
+	/// SM must not be used by other threads.
+	std::optional<transform_info> lookup(const EnumDecl *Enum,
+	                                     const SourceManager &SM) const {
+		auto entry = find(Enum);
+		if (!entry) {
+			return std::nullopt;
+		}
+		auto file = SM.getFileManager().getOptionalFileRef(getFileName(*entry));
+		if (!file) {
+			return std::nullopt;
+		}
+		auto id = SM.translateFile(*file);
+		if (id.isInvalid()) {
+			return std::nullopt;
+		}
+		return transform_info{.type = expand(entry->type, id, SM),
+		                      .start = expand(entry->start, id, SM)};
+	}
+
+	size_t size() const {
+		size_t count = 0;
+		for (const auto &shard : shards) {
+			std::shared_lock lock(shard.mutex);
+			count += shard.entries.size();
+		}
+		return count;
+	}
+
+	/// Print the qualified names of the stored enums, sorted
+	void print(llvm::raw_ostream &OS) const {
+		std::vector<std::string> names;
+		for (const auto &shard : shards) {
+			std::shared_lock lock(shard.mutex);
+			for (const auto &name : shard.names) {
+				names.push_back(name.getValue());
+			}
+		}
+		llvm::sort(names);
+		for (const auto &name : names) {
+			OS << name << "\n";
+		}
+	}
+
+   private:
+	struct Shard {
+		mutable std::shared_mutex mutex;
+		llvm::StringMap<Entry> entries;
+		/// Qualified name of each enum, by USR. Only read by print, so the
+		/// entries stay small.
+		llvm::StringMap<std::string> names;
+	};
+
+	static constexpr size_t shard_count = 16;
+
+	static std::string getUSR(const Decl *D) {
+		llvm::SmallString<128> usr;
+		if (clang::index::generateUSRForDecl(D, usr)) {
+			return "";
+		}
+		return usr.str().str();
+	}
+
+	static Range compact(CharSourceRange R, const SourceManager &SM) {
+		return {SM.getFileOffset(SM.getFileLoc(R.getBegin())),
+		        SM.getFileOffset(SM.getFileLoc(R.getEnd())),
+		        R.isTokenRange()};
+	}
+
+	static CharSourceRange expand(Range R, FileID File,
+	                              const SourceManager &SM) {
+		auto start = SM.getLocForStartOfFile(File);
+		return CharSourceRange(SourceRange(start.getLocWithOffset(R.begin),
+		                                   start.getLocWithOffset(R.end)),
+		                       R.is_token_range);
+	}
+
+	Shard &getShard(StringRef usr) {
+		return shards[llvm::xxHash64(usr) % shard_count];
+	}
+	const Shard &getShard(StringRef usr) const {
+		return shards[llvm::xxHash64(usr) % shard_count];
+	}
+
+	/// Files are stored once, and referred to by their position in `files`.
+	/// Reading a name takes the lock, as the deque itself may grow, but a
+	/// deque never moves its elements, so the name stays valid afterwards.
+	uint32_t getFileId(StringRef name) {
+		std::unique_lock lock(files_mutex);
+		auto [it, inserted] = file_ids.try_emplace(name, files.size());
+		if (inserted) {
+			files.push_back(name.str());
+		}
+		return it->second;
+	}
+
+	std::array<Shard, shard_count> shards;
+	mutable std::shared_mutex files_mutex;
+	llvm::StringMap<uint32_t> file_ids;
+	std::deque<std::string> files;
+};
 
 using resType = transformer::MatchConsumer<std::string>;
 
@@ -172,17 +358,25 @@ transformer::RangeSelector getDeclaratorType(StringRef Id) {
 	};
 }
 
-transformer::RangeSelector generateTransformInfoForDeclarator(StringRef Id) {
+/// Stores the ranges of the to_string method with the enum parameter Id in
+/// index
+transformer::RangeSelector generateTransformInfoForDeclarator(
+    StringRef Id, EnumIndex *index) {
 	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
 	           -> Expected<CharSourceRange> {
 		if (auto node = Match.Nodes.getNodeAs<DeclaratorDecl>(Id)) {
-			auto qualNodeName = node->getQualifiedNameAsString();
+			auto enum_type = node->getType()->getAs<EnumType>();
+			if (!enum_type) {
+				throw std::invalid_argument(append_file_line(
+				    "Node is not an enum parameter: " + Id.str()));
+			}
 
 			auto wholeNode = transformer::node(Id.str())(Match).get();
-			qualNodeName = node->getType().getAsString();
-
-			enums[qualNodeName] = transform_info{
-			    .type = getDeclaratorType(Id)(Match).get(), .start = wholeNode};
+			index->insert(
+			    enum_type->getDecl(),
+			    transform_info{.type = getDeclaratorType(Id)(Match).get(),
+			                   .start = wholeNode},
+			    *Match.SourceManager);
 
 			return wholeNode;
 		}
@@ -193,23 +387,20 @@ transformer::RangeSelector generateTransformInfoForDeclarator(StringRef Id) {
 }
 
 std::optional<transform_info> getStoredInfo(
-    StringRef Id, const ast_matchers::MatchFinder::MatchResult &Match) {
-	if (auto node = Match.Nodes.getNodeAs<NamedDecl>(Id)) {
-		auto qualName = node->getQualifiedNameAsString();
-
-		auto info = enums.find(qualName);
-		if (info != enums.end()) {
-			return info->second;
-		}
+    StringRef Id, const ast_matchers::MatchFinder::MatchResult &Match,
+    const EnumIndex *index) {
+	if (auto node = Match.Nodes.getNodeAs<EnumDecl>(Id)) {
+		return index->lookup(node, *Match.SourceManager);
 	}
 
 	return std::nullopt;
 }
 
-transformer::RangeSelector transformationRange(StringRef Id) {
+transformer::RangeSelector transformationRange(StringRef Id,
+                                               const EnumIndex *index) {
 	return [=](const ast_matchers::MatchFinder::MatchResult &Match)
 	           -> Expected<CharSourceRange> {
-		auto info = getStoredInfo(Id, Match);
+		auto info = getStoredInfo(Id, Match, index);
 		if (info) {
 			return info.value().start;
 		}
@@ -218,7 +409,8 @@ transformer::RangeSelector transformationRange(StringRef Id) {
 	};
 }
 
-transformer::Stencil generateToStringFromEnum(StringRef Id) {
+transformer::Stencil generateToStringFromEnum(StringRef Id,
+                                              const EnumIndex *index) {
 	return transformer::run([=](const ast_matchers::MatchFinder::MatchResult
 	                                &Match) -> Expected<std::string> {
 		auto enum_decl = Match.Nodes.getNodeAs<EnumDecl>(Id);
@@ -227,7 +419,7 @@ transformer::Stencil generateToStringFromEnum(StringRef Id) {
 			    "Node not bound or not an EnumDecl: " + Id.str()));
 		}
 
-		auto info = getStoredInfo(Id, Match);
+		auto info = getStoredInfo(Id, Match, index);
 
 		auto type = tooling::getText(
 		    info ? info.value().type : transformer::name(Id.str())(Match).get(),
@@ -252,6 +444,8 @@ transformer::Stencil generateToStringFromEnum(StringRef Id) {
 
 }  // end namespace NodeOps
 
+// The benchmarks include this file for its EnumIndex
+#ifndef ENUM_TO_STRING_V3_NO_MAIN
 int main(int argc, const char **argv) {
 	// Configuring the command-line options
 
@@ -281,10 +475,13 @@ int main(int argc, const char **argv) {
 	               ast_matchers::hasType(ast_matchers::enumDecl()))
 	               .bind("enumParm")));
 
+	// Results of the first phase, read by the second
+	NodeOps::EnumIndex index;
+
 	auto ruleCollectTransformInfoForAllToStringMethods = transformer::makeRule(
 	    findAllParmVarDeclsWithEnums,
 	    transformer::noopEdit(
-	        NodeOps::generateTransformInfoForDeclarator("enumParm")));
+	        NodeOps::generateTransformInfoForDeclarator("enumParm", &index)));
 	{
 		ast_matchers::MatchFinder finder;
 		tooling::Transformer transformer{
@@ -294,8 +491,8 @@ int main(int argc, const char **argv) {
 		tool.run(tooling::newFrontendActionFactory(&finder).get());
 	}
 
-	for (auto e : NodeOps::enums) {
-		std::cout << e.first << "\n";
+	if (PrintIndex) {
+		index.print(llvm::errs());
 	}
 
 	auto findAllEnums =
@@ -306,8 +503,9 @@ int main(int argc, const char **argv) {
 	    findAllEnums,
 	    {transformer::addInclude("string_view",
 	                             transformer::IncludeFormat::Angled),
-	     transformer::changeTo(NodeOps::transformationRange("enumDecl"),
-	                           NodeOps::generateToStringFromEnum("enumDecl"))});
+	     transformer::changeTo(
+	         NodeOps::transformationRange("enumDecl", &index),
+	         NodeOps::generateToStringFromEnum("enumDecl", &index))});
 	{
 		ast_matchers::MatchFinder finder;
 		tooling::Transformer transformer{ruleGenerateToString,
@@ -319,3 +517,4 @@ int main(int argc, const char **argv) {
 
 	return 0;
 }
+#endif
@@ -0,0 +1,124 @@
+// Benchmarks of the EnumIndex of enum_to_string_v3 against the string keyed
+// map it replaces, on ASTs built in memory.
+#define ENUM_TO_STRING_V3_NO_MAIN
+#include "enum_to_string_v3.cpp"
+
+#include "clang/Tooling/Tooling.h"
+
+#include <benchmark/benchmark.h>
+
+#include <unordered_map>
+
+using namespace clang::ast_matchers;
+
+/// N enums two namespaces deep, each with an existing to_string method
+static std::string generateEnums(int64_t N) {
+	std::string Code;
+	for (int64_t I = 0; I < N; ++I) {
+		auto Name = "E" + std::to_string(I);
+		Code += "namespace a { namespace b {\n"
+				"enum class " +
+				Name +
+				" { V0, V1, V2, V3 };\n"
+				"} }\n"
+				"constexpr int to_string(a::b::" +
+				Name + " e) { return 0; }\n";
+	}
+	return Code;
+}
+
+/// The AST and what the first phase stores for each of its enums
+struct Enums {
+	explicit Enums(int64_t N)
+		: AST(tooling::buildASTFromCodeWithArgs(generateEnums(N),
+												{"-std=c++17"})) {
+		auto &Context = AST->getASTContext();
+		for (const auto &Nodes :
+			 match(functionDecl(hasParameter(
+								0, parmVarDecl(hasType(enumDecl()))
+									   .bind("enumParm")))
+					   .bind("to_string"),
+				   Context)) {
+			auto *Parm = Nodes.getNodeAs<ParmVarDecl>("enumParm");
+			auto *Method = Nodes.getNodeAs<FunctionDecl>("to_string");
+			Parms.push_back(Parm);
+			Infos.push_back(NodeOps::transform_info{
+				.type = CharSourceRange::getTokenRange(
+					Parm->getTypeSourceInfo()->getTypeLoc().getSourceRange()),
+				.start = CharSourceRange::getTokenRange(
+					Method->getSourceRange())});
+		}
+		for (const auto &Nodes : match(enumDecl().bind("enumDecl"), Context)) {
+			Decls.push_back(Nodes.getNodeAs<EnumDecl>("enumDecl"));
+		}
+	}
+
+	const SourceManager &getSourceManager() const {
+		return AST->getSourceManager();
+	}
+
+	std::unique_ptr<ASTUnit> AST;
+	std::vector<const ParmVarDecl *> Parms;
+	std::vector<NodeOps::transform_info> Infos;
+	std::vector<const EnumDecl *> Decls;
+};
+
+/// The former global map: keyed by the parameter type when storing, and by
+/// the qualified name of the enum when reading
+static void BM_string_map(benchmark::State &State) {
+	Enums E(State.range(0));
+	for (auto _ : State) {
+		std::unordered_map<std::string, NodeOps::transform_info> Map;
+		for (size_t I = 0; I < E.Parms.size(); ++I) {
+			Map[E.Parms[I]->getType().getAsString()] = E.Infos[I];
+		}
+		for (const auto *Decl : E.Decls) {
+			auto It = Map.find(Decl->getQualifiedNameAsString());
+			benchmark::DoNotOptimize(It);
+		}
+	}
+	State.SetItemsProcessed(State.iterations() * E.Decls.size());
+}
+BENCHMARK(BM_string_map)->Arg(1000)->Arg(100000);
+
+static void BM_enum_index(benchmark::State &State) {
+	Enums E(State.range(0));
+	const auto &SM = E.getSourceManager();
+	for (auto _ : State) {
+		NodeOps::EnumIndex Index;
+		for (size_t I = 0; I < E.Parms.size(); ++I) {
+			Index.insert(E.Parms[I]->getType()->getAs<EnumType>()->getDecl(),
+						 E.Infos[I], SM);
+		}
+		for (const auto *Decl : E.Decls) {
+			benchmark::DoNotOptimize(Index.lookup(Decl, SM));
+		}
+	}
+	State.SetItemsProcessed(State.iterations() * E.Decls.size());
+}
+BENCHMARK(BM_enum_index)->Arg(1000)->Arg(100000);
+
+/// Every thread reads all enums from one shared index, like parallel workers
+/// of the second phase. Each worker would turn the entries back into ranges
+/// with its own SourceManager, so that part is left out.
+static void BM_enum_index_concurrent_find(benchmark::State &State) {
+	static Enums E(100000);
+	static NodeOps::EnumIndex Index;
+	static bool Filled = [] {
+		for (size_t I = 0; I < E.Parms.size(); ++I) {
+			Index.insert(E.Parms[I]->getType()->getAs<EnumType>()->getDecl(),
+						 E.Infos[I], E.getSourceManager());
+		}
+		return true;
+	}();
+	benchmark::DoNotOptimize(Filled);
+	for (auto _ : State) {
+		for (const auto *Decl : E.Decls) {
+			benchmark::DoNotOptimize(Index.find(Decl));
+		}
+	}
+	State.SetItemsProcessed(State.iterations() * E.Decls.size());
+}
+BENCHMARK(BM_enum_index_concurrent_find)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,269 @@
+// Lexical prefilter for the translation units of the tools.
+//
+// Most rules can only match if the main file contains some token, e.g. enum
+// for enum_to_string. The prefilter looks for the tokens of all rules in the
+// raw bytes of the main file, outside of comments and string and character
+// literals, without lexing or preprocessing it. A translation unit without
+// any of them is not parsed at all (see --prefilter of the tools).
+//
+// Candidates are found 16 bytes at a time with SSE2, by comparing the first
+// and the last byte of every token at once, next to the bytes starting a
+// comment or literal. Only the candidates are looked at one by one, and
+// comments and literals are skipped with find. Without SSE2, every byte is
+// looked up in a table instead.
+#ifndef TOKEN_PREFILTER_TOKEN_PREFILTER_H
+#define TOKEN_PREFILTER_TOKEN_PREFILTER_H
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <array>
+#include <optional>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace token_prefilter {
+
+/// Finds any of a set of tokens in code, see above
+class TokenPrefilter {
+  public:
+	/// Tokens must not be empty, nor start with '/', '"' or '\''. Tokens
+	/// starting or ending with an identifier character only match at the
+	/// boundaries of identifiers, so enum is not found in enumerate.
+	explicit TokenPrefilter(std::vector<std::string> Tokens)
+		: Tokens(std::move(Tokens)) {
+		for (char C : {'/', '"', '\''}) {
+			Candidates[static_cast<unsigned char>(C)] = true;
+		}
+		for (const auto &Token : this->Tokens) {
+			Candidates[static_cast<unsigned char>(Token.front())] = true;
+			MaxOffset = std::max(MaxOffset, Token.size() - 1);
+#ifdef __SSE2__
+			Ends.push_back(
+				{_mm_set1_epi8(Token.front()), _mm_set1_epi8(Token.back())});
+#endif
+		}
+	}
+
+	/// Whether Code contains one of the tokens outside of comments and
+	/// literals. Code the compiler would reject, like an unterminated
+	/// comment, counts as a match, so the compiler reports it. Tokens coming
+	/// from macros defined in other files are not seen, nor are the types
+	/// hidden behind a typedef, like an array typedef.
+	bool mayMatch(llvm::StringRef Code) const {
+		size_t I = 0;
+		while ((I = nextCandidate(Code, I)) != llvm::StringRef::npos) {
+			auto Rest = Code.substr(I);
+			if (Rest.startswith("//")) {
+				I = skipLineComment(Code, I);
+				continue;
+			}
+			if (Rest.startswith("/*")) {
+				auto End = Code.find("*/", I + 2);
+				if (End == llvm::StringRef::npos) {
+					return true;
+				}
+				I = End + 2;
+				continue;
+			}
+			if (Code[I] == '"') {
+				I = skipStringLiteral(Code, I);
+				continue;
+			}
+			if (Code[I] == '\'') {
+				I = skipCharLiteral(Code, I);
+				continue;
+			}
+			if (isTokenAt(Code, I)) {
+				return true;
+			}
+			++I;
+		}
+		return false;
+	}
+
+  private:
+	/// The first position from I on that could start a token, a comment or
+	/// a literal, or npos
+	size_t nextCandidate(llvm::StringRef Code, size_t I) const {
+#ifdef __SSE2__
+		const char *Data = Code.data();
+		const auto Slash = _mm_set1_epi8('/');
+		const auto Quote = _mm_set1_epi8('"');
+		const auto Apostrophe = _mm_set1_epi8('\'');
+		for (; I + 16 + MaxOffset <= Code.size(); I += 16) {
+			auto Chunk = _mm_loadu_si128(
+				reinterpret_cast<const __m128i *>(Data + I));
+			auto Hits = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(Chunk, Slash),
+							 _mm_cmpeq_epi8(Chunk, Quote)),
+				_mm_cmpeq_epi8(Chunk, Apostrophe));
+			for (size_t T = 0; T < Tokens.size(); ++T) {
+				auto Last = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+					Data + I + Tokens[T].size() - 1));
+				Hits = _mm_or_si128(
+					Hits, _mm_and_si128(_mm_cmpeq_epi8(Chunk, Ends[T].First),
+										_mm_cmpeq_epi8(Last, Ends[T].Last)));
+			}
+			if (unsigned Mask = _mm_movemask_epi8(Hits)) {
+				return I + __builtin_ctz(Mask);
+			}
+		}
+#endif
+		for (; I < Code.size(); ++I) {
+			if (Candidates[static_cast<unsigned char>(Code[I])]) {
+				return I;
+			}
+		}
+		return llvm::StringRef::npos;
+	}
+
+	bool isTokenAt(llvm::StringRef Code, size_t I) const {
+		for (const auto &Token : Tokens) {
+			if (!Code.substr(I).startswith(Token)) {
+				continue;
+			}
+			size_t End = I + Token.size();
+			if (isIdentifierChar(Token.front()) && I > 0 &&
+				isIdentifierChar(Code[I - 1])) {
+				continue;
+			}
+			if (isIdentifierChar(Token.back()) && End < Code.size() &&
+				isIdentifierChar(Code[End])) {
+				continue;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	static bool isIdentifierChar(char C) {
+		// Bytes of UTF-8 sequences can be part of identifiers too
+		return llvm::isAlnum(C) || C == '_' ||
+			   static_cast<unsigned char>(C) >= 0x80;
+	}
+
+	static bool isEncodingPrefix(llvm::StringRef Prefix) {
+		return Prefix == "u8" || Prefix == "u" || Prefix == "U" ||
+			   Prefix == "L";
+	}
+
+	/// The identifier, or number, that ends right before I
+	static llvm::StringRef identifierBefore(llvm::StringRef Code, size_t I) {
+		size_t Start = I;
+		while (Start > 0 && isIdentifierChar(Code[Start - 1])) {
+			--Start;
+		}
+		return Code.slice(Start, I);
+	}
+
+	/// The position after the line comment at I. A backslash at the end of a
+	/// line continues the comment, like in the compiler.
+	static size_t skipLineComment(llvm::StringRef Code, size_t I) {
+		while (true) {
+			auto End = Code.find('\n', I);
+			if (End == llvm::StringRef::npos) {
+				return Code.size();
+			}
+			if (!Code.slice(I, End).rtrim().endswith("\\")) {
+				return End + 1;
+			}
+			I = End + 1;
+		}
+	}
+
+	/// The position after the literal whose opening Quote is at I, with
+	/// escaped characters. If it does not end on its line, the position after
+	/// the quote, so nothing is skipped that may be code.
+	static size_t skipQuoted(llvm::StringRef Code, size_t I, char Quote) {
+		const char Ends[] = {Quote, '\\', '\n', '\0'};
+		for (size_t J = I + 1; J < Code.size(); J += 2) {
+			J = Code.find_first_of(Ends, J);
+			if (J == llvm::StringRef::npos || Code[J] == '\n') {
+				break;
+			}
+			if (Code[J] == Quote) {
+				return J + 1;
+			}
+		}
+		return I + 1;
+	}
+
+	static size_t skipStringLiteral(llvm::StringRef Code, size_t I) {
+		bool Raw = I > 0 && Code[I - 1] == 'R' &&
+				   (identifierBefore(Code, I - 1).empty() ||
+					isEncodingPrefix(identifierBefore(Code, I - 1)));
+		if (!Raw) {
+			return skipQuoted(Code, I, '"');
+		}
+
+		// R"delimiter( ... )delimiter"
+		auto Open = Code.find('(', I + 1);
+		if (Open == llvm::StringRef::npos) {
+			return I + 1;
+		}
+		auto Delimiter = Code.slice(I + 1, Open);
+		if (Delimiter.size() > 16 ||
+			Delimiter.find_first_of(" ()\\\t\v\f\r\n\"") !=
+				llvm::StringRef::npos) {
+			return I + 1;
+		}
+		auto End = Code.find((")" + Delimiter + "\"").str(), Open + 1);
+		if (End == llvm::StringRef::npos) {
+			return I + 1;
+		}
+		return End + Delimiter.size() + 2;
+	}
+
+	static size_t skipCharLiteral(llvm::StringRef Code, size_t I) {
+		// Within a number, e.g. 1'000, the quote separates digits
+		auto Before = identifierBefore(Code, I);
+		if (!Before.empty() && !isEncodingPrefix(Before)) {
+			return I + 1;
+		}
+		return skipQuoted(Code, I, '\'');
+	}
+
+	std::vector<std::string> Tokens;
+	/// The bytes nextCandidate stops at
+	std::array<bool, 256> Candidates{};
+	/// The largest offset of the last byte of a token
+	size_t MaxOffset = 0;
+#ifdef __SSE2__
+	/// The first and the last byte of a token, in every lane
+	struct TokenEnds {
+		__m128i First, Last;
+	};
+	std::vector<TokenEnds> Ends;
+#endif
+};
+
+/// The prefilter of Rules, each with a Name and the Tokens it needs one of
+/// to match, or none if a rule can match without a token, as a translation
+/// unit can only be skipped if every rule needs one
+template <typename RuleRange>
+std::optional<TokenPrefilter> makePrefilter(const RuleRange &Rules) {
+	std::vector<std::string> Tokens;
+	for (const auto &Rule : Rules) {
+		if (Rule.Tokens.empty()) {
+			llvm::errs() << "Not prefiltering, " << Rule.Name
+						 << " can match without a token\n";
+			return std::nullopt;
+		}
+		llvm::append_range(Tokens, Rule.Tokens);
+	}
+	if (Tokens.empty()) {
+		return std::nullopt;
+	}
+	return TokenPrefilter(std::move(Tokens));
+}
+
+} // namespace token_prefilter
+
+#endif
@@ -0,0 +1,743 @@
+// Infrastructure shared by the tools: the caches, the instrumentation of
+// the matchers, the sharding, and the writing of files.
+//
+// enum_to_string, c_style_array_converter and apply_changes include this
+// header, and the transformation_driver gets it through the tools. Everything
+// is in the namespace tool_support and names the clang and LLVM types in
+// full, as the tools have different using-directives.
+#ifndef TOOL_SUPPORT_TOOL_SUPPORT_H
+#define TOOL_SUPPORT_TOOL_SUPPORT_H
+
+#include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/MultiplexConsumer.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Tooling/Refactoring/AtomicChange.h"
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Transformer/Transformer.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tool_support {
+
+/// Modification time and size of File. Empty if the file does not exist.
+inline std::string getFileStamp(llvm::StringRef File) {
+	llvm::sys::fs::file_status Status;
+	if (llvm::sys::fs::status(File, Status)) {
+		return "";
+	}
+	return std::to_string(
+			   Status.getLastModificationTime().time_since_epoch().count()) +
+		   ":" + std::to_string(Status.getSize());
+}
+
+/// Records every file a compilation reads, system headers included
+struct AllDependencies : public clang::DependencyCollector {
+	bool needSystemDependencies() override { return true; }
+};
+
+/// Write Content to Path through a temporary file and a rename, so other
+/// processes sharing a cache never see a partial file. Prints an error if
+/// that fails.
+/// \returns false if Path could not be written
+inline bool writeCacheFile(llvm::StringRef Path, llvm::StringRef Content) {
+	auto Err = llvm::writeToOutput(Path, [&](llvm::raw_ostream &Out) {
+		Out << Content;
+		return llvm::Error::success();
+	});
+	if (Err) {
+		llvm::errs() << "Could not write " << Path << ": "
+					 << llvm::toString(std::move(Err)) << "\n";
+		return false;
+	}
+	return true;
+}
+
+/// Replace File by a temporary file written next to it, so an interrupted
+/// run never leaves a partial file. Keeps the permissions of File, if it
+/// exists.
+inline llvm::Error writeFileAtomically(llvm::StringRef File,
+									   llvm::StringRef Content) {
+	auto Permissions = llvm::sys::fs::all_read | llvm::sys::fs::owner_write;
+	llvm::sys::fs::file_status Status;
+	if (auto EC = llvm::sys::fs::status(File, Status)) {
+		if (EC != std::errc::no_such_file_or_directory) {
+			return llvm::createFileError(File, EC);
+		}
+	} else {
+		Permissions = Status.permissions();
+	}
+
+	int FD;
+	llvm::SmallString<256> Tmp;
+	if (auto EC = llvm::sys::fs::createUniqueFile(File + ".tmp-%%%%%%", FD,
+												  Tmp, llvm::sys::fs::OF_None,
+												  Permissions)) {
+		return llvm::createFileError(File, EC);
+	}
+	{
+		llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+		Out << Content;
+		Out.close();
+		if (Out.has_error()) {
+			auto EC = Out.error();
+			Out.clear_error();
+			llvm::sys::fs::remove(Tmp);
+			return llvm::createFileError(Tmp, EC);
+		}
+	}
+	if (auto EC = llvm::sys::fs::rename(Tmp, File)) {
+		llvm::sys::fs::remove(Tmp);
+		return llvm::createFileError(File, EC);
+	}
+	return llvm::Error::success();
+}
+
+/// Print the non-empty errors
+/// \returns true if there were any
+inline bool printErrors(llvm::ArrayRef<std::string> Errors) {
+	bool Failed = false;
+	for (const auto &Message : Errors) {
+		if (!Message.empty()) {
+			llvm::errs() << Message << "\n";
+			Failed = true;
+		}
+	}
+	return Failed;
+}
+
+/// Write the new code of each file, given as its path and code, with
+/// writeFileAtomically on Pool, and report how long that took. Reading and
+/// writing is mostly waiting on I/O, so Pool can use all threads.
+/// \returns false, after printing the errors, if any file failed
+inline bool
+writeFiles(llvm::ThreadPool &Pool,
+		   llvm::ArrayRef<std::pair<llvm::StringRef, llvm::StringRef>> Files) {
+	llvm::TimeTraceScope Scope("Write files");
+	auto Start = std::chrono::steady_clock::now();
+	std::vector<std::string> Errors(Files.size());
+	for (size_t I = 0; I < Files.size(); ++I) {
+		Pool.async([&, I] {
+			auto [File, Code] = Files[I];
+			if (auto Err = writeFileAtomically(File, Code)) {
+				Errors[I] = llvm::toString(std::move(Err));
+			}
+		});
+	}
+	Pool.wait();
+	auto Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - Start);
+	llvm::errs() << "Wrote " << Files.size() << " files in " << Elapsed.count()
+				 << "ms\n";
+	return !printErrors(Errors);
+}
+
+/// On-disk cache of precompiled preambles, i.e. the block of #include
+/// directives at the top of a source file. A preamble is keyed by its text and
+/// the compile flags of the file, so files including the same headers with the
+/// same flags share one PCH, both within a run and across runs.
+class PreambleCache {
+  public:
+	PreambleCache(
+		llvm::StringRef Dir,
+		std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps)
+		: Dir(Dir), PCHContainerOps(std::move(PCHContainerOps)) {}
+
+	/// Arguments adjuster that builds or reuses the preamble of each file, and
+	/// makes the compiler skip the preamble of the file and load the PCH
+	/// instead. Files without a usable preamble are left untouched.
+	clang::tooling::ArgumentsAdjuster getAdjuster() {
+		return [this](const clang::tooling::CommandLineArguments &Args,
+					  llvm::StringRef Filename) {
+			auto Preamble = getPreamble(Args, Filename);
+			if (!Preamble) {
+				return Args;
+			}
+
+			clang::tooling::CommandLineArguments Adjusted(Args);
+			Adjusted.insert(
+				Adjusted.begin() + 1,
+				{"-include-pch", Preamble->PCH, "-Xclang",
+				 "-preamble-bytes=" + std::to_string(Preamble->Bounds.Size) +
+					 "," +
+					 (Preamble->Bounds.PreambleEndsAtStartOfLine ? "1" : "0")});
+			return Adjusted;
+		};
+	}
+
+  private:
+	struct Preamble {
+		std::string PCH;
+		clang::PreambleBounds Bounds;
+	};
+
+	/// Generates the PCH and collects the files it depends on
+	struct BuildPreambleAction : public clang::GeneratePCHAction {
+		explicit BuildPreambleAction(std::shared_ptr<AllDependencies> Deps)
+			: Deps(std::move(Deps)) {}
+
+		bool BeginSourceFileAction(clang::CompilerInstance &CI) override {
+			Deps->attachToPreprocessor(CI.getPreprocessor());
+			return clang::GeneratePCHAction::BeginSourceFileAction(CI);
+		}
+
+		std::shared_ptr<AllDependencies> Deps;
+	};
+
+	std::optional<Preamble>
+	getPreamble(const clang::tooling::CommandLineArguments &Args,
+				llvm::StringRef Filename) {
+		llvm::SmallString<256> MainFile(Filename);
+		llvm::sys::fs::make_absolute(MainFile);
+		auto Buffer = llvm::MemoryBuffer::getFile(MainFile);
+		if (!Buffer) {
+			return std::nullopt;
+		}
+
+		clang::LangOptions LangOpts;
+		LangOpts.CPlusPlus = true;
+		auto Bounds =
+			clang::Lexer::ComputePreamble((*Buffer)->getBuffer(), LangOpts);
+		if (Bounds.Size == 0) {
+			return std::nullopt;
+		}
+		auto Text = (*Buffer)->getBuffer().take_front(Bounds.Size);
+
+		// The flags used to build the preamble. Quoted includes are resolved
+		// relative to the main file, but the preamble lives in the cache.
+		clang::tooling::CommandLineArguments Flags;
+		for (const auto &Arg : Args) {
+			if (Arg != Filename && Arg != "-fsyntax-only") {
+				Flags.push_back(Arg);
+			}
+		}
+		Flags.push_back("-iquote");
+		Flags.push_back(llvm::sys::path::parent_path(MainFile).str());
+
+		std::string Key = Text.str();
+		for (const auto &Flag : Flags) {
+			Key += '\0' + Flag;
+		}
+		llvm::SmallString<256> Base(Dir);
+		llvm::sys::path::append(Base, llvm::utohexstr(llvm::xxHash64(Key)));
+		std::string PCH = (Base + ".pch").str();
+
+		// Parallel workers needing the same preamble wait for it instead of
+		// building it again. Other preambles are built at the same time.
+		std::lock_guard<std::mutex> Lock(getPreambleMutex(PCH));
+		if (!isUpToDate(PCH, Base + ".deps") &&
+			!build(Flags, Text, Base, PCH)) {
+			llvm::errs() << "Could not precompile the preamble of " << Filename
+						 << ". Parsing it without.\n";
+			return std::nullopt;
+		}
+		return Preamble{PCH, Bounds};
+	}
+
+	bool build(const clang::tooling::CommandLineArguments &Flags,
+			   llvm::StringRef Text, llvm::StringRef Base,
+			   llvm::StringRef PCH) {
+		if (auto EC = llvm::sys::fs::create_directories(Dir)) {
+			llvm::errs() << "Could not create " << Dir << ": " << EC.message()
+						 << "\n";
+			return false;
+		}
+
+		// The PCH includes the header implicitly while the main file skips
+		// the preamble. `#pragma once` makes sure it is only processed once.
+		std::string Header = (Base + ".h").str();
+		llvm::TimeTraceScope Scope("Build preamble", Header);
+		if (!writeCacheFile(Header, "#pragma once\n" + Text.str())) {
+			return false;
+		}
+
+		// Build to a temporary file, so other processes never see a partial PCH
+		std::string Tmp =
+			(PCH + "." + std::to_string(llvm::sys::Process::getProcessId()))
+				.str();
+		std::vector<std::string> CommandLine(Flags.begin(), Flags.end());
+		CommandLine.insert(CommandLine.end(),
+						   {"-x", "c++-header", Header, "-o", Tmp});
+
+		auto Deps = std::make_shared<AllDependencies>();
+		llvm::IntrusiveRefCntPtr<clang::FileManager> Files(
+			new clang::FileManager(clang::FileSystemOptions()));
+		clang::tooling::ToolInvocation Invocation(
+			CommandLine, std::make_unique<BuildPreambleAction>(Deps),
+			Files.get(), PCHContainerOps);
+		if (!Invocation.run()) {
+			llvm::sys::fs::remove(Tmp);
+			return false;
+		}
+
+		std::string Stamps;
+		for (const auto &Dep : Deps->getDependencies()) {
+			Stamps += getFileStamp(Dep) + " " + Dep + "\n";
+		}
+		return writeCacheFile((Base + ".deps").str(), Stamps) &&
+			   !llvm::sys::fs::rename(Tmp, PCH);
+	}
+
+	/// The mutex held while the preamble PCH is checked or built
+	std::mutex &getPreambleMutex(llvm::StringRef PCH) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		auto &PreambleMutex = PreambleMutexes[PCH];
+		if (!PreambleMutex) {
+			PreambleMutex = std::make_unique<std::mutex>();
+		}
+		return *PreambleMutex;
+	}
+
+	/// A PCH is up to date if none of the files it was built from changed
+	static bool isUpToDate(llvm::StringRef PCH, const llvm::Twine &Deps) {
+		if (!llvm::sys::fs::exists(PCH)) {
+			return false;
+		}
+		auto Buffer = llvm::MemoryBuffer::getFile(Deps);
+		if (!Buffer) {
+			return false;
+		}
+
+		llvm::SmallVector<llvm::StringRef> Lines;
+		(*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+		for (auto Line : Lines) {
+			auto [Stamp, File] = Line.split(' ');
+			if (Stamp != getFileStamp(File)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::string Dir;
+	std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps;
+	/// Only held to look up or insert in PreambleMutexes
+	std::mutex Mutex;
+	llvm::StringMap<std::unique_ptr<std::mutex>> PreambleMutexes;
+};
+
+/// Append Change to Out as the size of its YAML, a line break and the YAML.
+/// The format of the result cache.
+inline void
+appendSerializedChange(const clang::tooling::AtomicChange &Change,
+					   std::string &Out) {
+	auto YAML = Change.toYAMLString();
+	Out += std::to_string(YAML.size()) + "\n" + YAML;
+}
+
+/// The YAML of each change appended to Data by appendSerializedChange. None
+/// if Data is truncated.
+inline std::optional<std::vector<llvm::StringRef>>
+splitSerializedChanges(llvm::StringRef Data) {
+	std::vector<llvm::StringRef> Changes;
+	for (auto Rest = Data; !Rest.empty();) {
+		auto [Size, Tail] = Rest.split('\n');
+		size_t Length;
+		if (Size.getAsInteger(10, Length) || Length > Tail.size()) {
+			return std::nullopt;
+		}
+		Changes.push_back(Tail.take_front(Length));
+		Rest = Tail.drop_front(Length);
+	}
+	return Changes;
+}
+
+/// On-disk cache of the changes generated for each translation unit. An entry
+/// is addressed by the contents of the main file, its compile command, the
+/// build of the tool itself and the configuration of its rules. It also lists
+/// the content hash of every file the translation unit was built from, and is
+/// only used if all of them still match. The stored changes and metadata are
+/// then replayed without running the frontend.
+class ResultCache {
+  public:
+	/// The changes of a translation unit, and the metadata the tool printed
+	/// for them
+	struct Result {
+		clang::tooling::AtomicChanges Changes;
+		std::string Metadata;
+	};
+
+	/// Config holds everything else the changes depend on, e.g. the rules and
+	/// the values of the options they read
+	ResultCache(llvm::StringRef Dir,
+				const clang::tooling::CompilationDatabase &Compilations,
+				llvm::StringRef Config)
+		: Dir(Dir), Compilations(Compilations), Config(Config),
+		  // Another build of the tool might generate other changes
+		  ToolStamp(getFileStamp(llvm::sys::fs::getMainExecutable(
+			  nullptr, reinterpret_cast<void *>(&getFileStamp)))) {}
+
+	/// The cached result of File. None if there is no up to date entry for
+	/// File.
+	std::optional<Result> replay(llvm::StringRef File) {
+		auto Cached = lookup(File);
+		++(Cached ? Hits : Misses);
+		return Cached;
+	}
+
+	/// Store the changes of File and their Metadata. Deps are all the files it
+	/// was built from, relative to the directory of its compile command.
+	void store(llvm::StringRef File, llvm::ArrayRef<std::string> Deps,
+			   llvm::ArrayRef<const clang::tooling::AtomicChange *> Changes,
+			   llvm::StringRef Metadata = "") {
+		auto Entry = getEntry(File);
+		if (!Entry) {
+			return;
+		}
+
+		auto Commands = Compilations.getCompileCommands(Entry->second);
+		std::string Manifest;
+		for (const auto &Dep : Deps) {
+			llvm::SmallString<256> Path(Dep);
+			if (Commands.empty()) {
+				llvm::sys::fs::make_absolute(Path);
+			} else {
+				llvm::sys::fs::make_absolute(Commands.front().Directory, Path);
+			}
+			auto Hash = getContentHash(Path);
+			if (Hash.empty()) {
+				return;
+			}
+			Manifest += Hash + " " + Path.str().str() + "\n";
+		}
+
+		// An empty list of changes is stored as well, as it saves a parse too
+		std::string Stored;
+		for (const auto *Change : Changes) {
+			appendSerializedChange(*Change, Stored);
+		}
+
+		if (auto EC = llvm::sys::fs::create_directories(Dir)) {
+			llvm::errs() << "Could not create " << Dir << ": " << EC.message()
+						 << "\n";
+			return;
+		}
+		// The manifest is written last, so only complete entries are found
+		if (writeCacheFile(Entry->first + ".changes", Stored) &&
+			writeCacheFile(Entry->first + ".metadata", Metadata)) {
+			writeCacheFile(Entry->first + ".manifest", Manifest);
+		}
+	}
+
+	void printStats(llvm::raw_ostream &OS) const {
+		OS << "Result cache: " << Hits << " hits, " << Misses << " misses\n";
+	}
+
+  private:
+	std::optional<Result> lookup(llvm::StringRef File) {
+		auto Entry = getEntry(File);
+		if (!Entry) {
+			return std::nullopt;
+		}
+		auto Manifest = llvm::MemoryBuffer::getFile(Entry->first + ".manifest");
+		if (!Manifest) {
+			return std::nullopt;
+		}
+
+		llvm::SmallVector<llvm::StringRef> Lines;
+		(*Manifest)->getBuffer().split(Lines, '\n', -1, false);
+		for (auto Line : Lines) {
+			auto [Hash, Dep] = Line.split(' ');
+			if (Hash != getContentHash(Dep)) {
+				return std::nullopt;
+			}
+		}
+
+		auto Stored = llvm::MemoryBuffer::getFile(Entry->first + ".changes");
+		if (!Stored) {
+			return std::nullopt;
+		}
+		auto Metadata = llvm::MemoryBuffer::getFile(Entry->first + ".metadata");
+		if (!Metadata) {
+			return std::nullopt;
+		}
+		auto YAMLs = splitSerializedChanges((*Stored)->getBuffer());
+		if (!YAMLs) {
+			return std::nullopt;
+		}
+		Result Cached;
+		for (auto YAML : *YAMLs) {
+			Cached.Changes.push_back(
+				clang::tooling::AtomicChange::convertFromYAML(YAML));
+		}
+		Cached.Metadata = (*Metadata)->getBuffer().str();
+		return Cached;
+	}
+
+	/// Path of the entry for File without extension, and the absolute path of
+	/// File. None if File cannot be read.
+	std::optional<std::pair<std::string, std::string>>
+	getEntry(llvm::StringRef File) {
+		llvm::SmallString<256> MainFile(File);
+		llvm::sys::fs::make_absolute(MainFile);
+		auto Buffer = llvm::MemoryBuffer::getFile(MainFile);
+		if (!Buffer) {
+			return std::nullopt;
+		}
+
+		std::string Key = ToolStamp + '\0' + Config + '\0' +
+						  (*Buffer)->getBuffer().str();
+		for (const auto &Command : Compilations.getCompileCommands(MainFile)) {
+			Key += '\0' + Command.Directory;
+			for (const auto &Arg : Command.CommandLine) {
+				Key += '\0' + Arg;
+			}
+		}
+		llvm::SmallString<256> Entry(Dir);
+		llvm::sys::path::append(Entry, llvm::utohexstr(llvm::xxHash64(Key)));
+		return std::make_pair(Entry.str().str(), MainFile.str().str());
+	}
+
+	/// Hash of the contents of File, computed once per run since many
+	/// translation units share headers. Empty if the file cannot be read.
+	std::string getContentHash(llvm::StringRef File) {
+		{
+			std::lock_guard<std::mutex> Lock(Mutex);
+			auto It = Hashes.find(File);
+			if (It != Hashes.end()) {
+				return It->second;
+			}
+		}
+
+		std::string Hash;
+		if (auto Buffer = llvm::MemoryBuffer::getFile(File)) {
+			Hash = llvm::utohexstr(llvm::xxHash64((*Buffer)->getBuffer()));
+		}
+		std::lock_guard<std::mutex> Lock(Mutex);
+		Hashes.try_emplace(File, Hash);
+		return Hash;
+	}
+
+	std::string Dir;
+	const clang::tooling::CompilationDatabase &Compilations;
+	std::string Config;
+	std::string ToolStamp;
+	llvm::StringMap<std::string> Hashes;
+	std::mutex Mutex;
+	std::atomic<unsigned> Hits{0};
+	std::atomic<unsigned> Misses{0};
+};
+
+/// Collects every file the translation units of a ClangTool are built from,
+/// including the files read through a precompiled preamble
+struct CollectDependencies : public clang::tooling::SourceFileCallbacks {
+	bool handleBeginSource(clang::CompilerInstance &CI) override {
+		// Attached to the ASTReader by CompilerInstance once a PCH is loaded
+		CI.addDependencyCollector(Deps);
+		Deps->attachToPreprocessor(CI.getPreprocessor());
+		return true;
+	}
+
+	std::shared_ptr<AllDependencies> Deps = std::make_shared<AllDependencies>();
+};
+
+/// Wraps the consumer of a MatchFinder. Lets Sema skip every function body
+/// outside the main file when the frontend runs with -skip-function-bodies.
+/// Bodies whose parse can affect the main file (constexpr functions and deduced
+/// return types) are never skipped by Sema. Also traces the traversal of the
+/// MatchFinder, which runs once the whole file is parsed, and calls OnMatched
+/// after it.
+struct MatchASTConsumer : public clang::MultiplexConsumer {
+	using clang::MultiplexConsumer::MultiplexConsumer;
+
+	bool shouldSkipFunctionBody(clang::Decl *D) override {
+		const auto &SM = D->getASTContext().getSourceManager();
+		return !SM.isInMainFile(SM.getExpansionLoc(D->getLocation()));
+	}
+
+	void HandleTranslationUnit(clang::ASTContext &Context) override {
+		llvm::TimeTraceScope Scope("Match", [&] {
+			const auto &SM = Context.getSourceManager();
+			return SM.getFileEntryRefForID(SM.getMainFileID())->getName().str();
+		});
+		clang::MultiplexConsumer::HandleTranslationUnit(Context);
+		if (OnMatched) {
+			OnMatched();
+		}
+	}
+
+	std::function<void()> OnMatched;
+};
+
+/// Wraps the consumer of a MatchFinder in a MatchASTConsumer
+struct MatchConsumerFactory {
+	std::unique_ptr<clang::ASTConsumer> newASTConsumer() {
+		std::vector<std::unique_ptr<clang::ASTConsumer>> Consumers;
+		Consumers.push_back(Finder.newASTConsumer());
+		auto Consumer =
+			std::make_unique<MatchASTConsumer>(std::move(Consumers));
+		Consumer->OnMatched = OnMatched;
+		return Consumer;
+	}
+
+	clang::ast_matchers::MatchFinder &Finder;
+	std::function<void()> OnMatched;
+};
+
+/// Records the trace of a task run by a llvm::ThreadPool while it lives, if
+/// Enabled. Every task records its own trace, as only the thread that started
+/// a trace can finish it.
+class TaskTrace {
+  public:
+	TaskTrace(bool Enabled, llvm::StringRef ProcessName) {
+		if (Enabled) {
+			llvm::timeTraceProfilerInitialize(0, ProcessName);
+		}
+	}
+	~TaskTrace() {
+		if (llvm::getTimeTraceProfilerInstance()) {
+			llvm::timeTraceProfilerFinishThread();
+		}
+	}
+	TaskTrace(const TaskTrace &) = delete;
+	TaskTrace &operator=(const TaskTrace &) = delete;
+};
+
+/// Transformer that is reported by the name of its rule in the profile of a
+/// MatchFinder, and counts its matches
+class NamedTransformer : public clang::tooling::Transformer {
+  public:
+	template <typename... ArgTs>
+	NamedTransformer(std::string Name, ArgTs &&...Args)
+		: Transformer(std::forward<ArgTs>(Args)...), Name(std::move(Name)) {}
+
+	llvm::StringRef getID() const override { return Name; }
+
+	void
+	run(const clang::ast_matchers::MatchFinder::MatchResult &Result) override {
+		++Matches;
+		Transformer::run(Result);
+	}
+
+	/// The number of matches since the last call
+	unsigned takeMatches() { return std::exchange(Matches, 0); }
+
+  private:
+	std::string Name;
+	unsigned Matches = 0;
+};
+
+/// Time spent in the matchers of each rule, its consumer included, and the
+/// number of matches. Summed over all translation units.
+class MatcherProfile {
+  public:
+	explicit MatcherProfile(llvm::StringRef JSONFile) : JSONFile(JSONFile) {}
+
+	void add(llvm::StringRef Rule, const llvm::TimeRecord &Time,
+			 unsigned Matches) {
+		std::lock_guard<std::mutex> Lock(Mutex);
+		auto &Entry = Entries[Rule];
+		Entry.Time += Time;
+		Entry.Matches += Matches;
+	}
+
+	/// Print the rules by descending wall time, and write them to the JSON
+	/// file in the same order
+	void report(llvm::raw_ostream &OS) {
+		std::vector<const llvm::StringMapEntry<Entry> *> Sorted;
+		for (const auto &Rule : Entries) {
+			Sorted.push_back(&Rule);
+		}
+		llvm::sort(Sorted, [](const auto *A, const auto *B) {
+			return A->getValue().Time.getWallTime() >
+				   B->getValue().Time.getWallTime();
+		});
+
+		OS << llvm::format("%10s %10s %10s %10s  %s\n", "Wall (s)", "User (s)",
+						   "System (s)", "Matches", "Rule");
+		for (const auto *Rule : Sorted) {
+			const auto &Time = Rule->getValue().Time;
+			OS << llvm::format("%10.4f %10.4f %10.4f %10u  ",
+							   Time.getWallTime(), Time.getUserTime(),
+							   Time.getSystemTime(), Rule->getValue().Matches)
+			   << Rule->getKey() << "\n";
+		}
+
+		auto Err = llvm::writeToOutput(JSONFile, [&](llvm::raw_ostream &Out) {
+			llvm::json::OStream JSON(Out, 2);
+			JSON.array([&] {
+				for (const auto *Rule : Sorted) {
+					const auto &Time = Rule->getValue().Time;
+					JSON.object([&] {
+						JSON.attribute("rule", Rule->getKey());
+						JSON.attribute("wall", Time.getWallTime());
+						JSON.attribute("user", Time.getUserTime());
+						JSON.attribute("system", Time.getSystemTime());
+						JSON.attribute("matches", Rule->getValue().Matches);
+					});
+				}
+			});
+			return llvm::Error::success();
+		});
+		if (Err) {
+			llvm::errs() << "Could not write the matcher profile: "
+						 << llvm::toString(std::move(Err)) << "\n";
+		}
+	}
+
+  private:
+	struct Entry {
+		llvm::TimeRecord Time;
+		unsigned Matches = 0;
+	};
+
+	std::string JSONFile;
+	llvm::StringMap<Entry> Entries;
+	std::mutex Mutex;
+};
+
+/// Parse the i/N of --shard
+/// \returns false if Spec is not a valid shard
+inline bool parseShard(llvm::StringRef Spec, unsigned &Index,
+					   unsigned &Count) {
+	auto [I, N] = Spec.split('/');
+	return !I.getAsInteger(10, Index) && !N.getAsInteger(10, Count) &&
+		   Index < Count;
+}
+
+/// Whether File belongs to shard Index out of Count. The path is hashed
+/// relative to the working directory, so all shards agree whether they are
+/// given absolute or relative paths, and in checkouts in other places too.
+inline bool isInShard(llvm::StringRef File, unsigned Index, unsigned Count) {
+	llvm::SmallString<256> Path(File);
+	llvm::sys::fs::make_absolute(Path);
+	llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+	llvm::SmallString<256> Cwd;
+	llvm::StringRef Key = Path;
+	if (!llvm::sys::fs::current_path(Cwd) && Key.consume_front(Cwd) &&
+		!Key.consume_front("/")) {
+		// Only a prefix of a directory name, e.g. /src-old in /src
+		Key = Path;
+	}
+	return llvm::xxHash64(Key) % Count == Index;
+}
+
+} // namespace tool_support
+
+#endif
@@ -18,6 +18,8 @@ using ::clang::transformer::cat;
 using ::clang::transformer::node;
 using transformer::noopEdit;
 
+// The driver includes this file for its rename rule only
+#ifndef TRANSFORMATION_BASE_PROJECT_RULES_ONLY
 struct MyConsumer {
     // Pass a reference of a map (i.e., one that a Tool uses) and save it in the member
     explicit MyConsumer(std::map<std::string, Replacements> &FilesToReplace) : FilesToReplace(FilesToReplace) {}
@@ -68,7 +70,30 @@ private:
     // Reference to a map that the Tool uses
     std::map<std::string, Replacements> &FilesToReplace;
 };
+#endif
 
+//Rule renaming the function ``MkX`` and all calls to it to ``MakeX``
+transformer::RewriteRuleWith<std::string> makeRenameFunctionAndAllInvocationsOfItRule() {
+    //Rule to rename the function rule
+    auto RenameInvalidFunctionNameRule = makeRule(
+            functionDecl(hasName("MkX")).bind("fun"),
+            changeTo(clang::transformer::name("fun"), cat("MakeX")),
+            cat("The name ``MkX`` is not allowed for functions; the function has been renamed")
+    );
+
+    //Rule to rename all expressions that calls the ``MkX`` function
+    auto RenameAllInvocationsOfInvalidFunctionNameRule =
+            makeRule(
+                    declRefExpr(to(functionDecl(hasName("MkX")))),
+                    changeTo(cat("MakeX")), cat("Referencing the invalid function ``MkX`` renaming to ``MakeX``")
+            );
+
+    //Combination of rules rename function and rename calls to function.
+    return clang::transformer::applyFirst(
+            {RenameInvalidFunctionNameRule, RenameAllInvocationsOfInvalidFunctionNameRule});
+}
+
+#ifndef TRANSFORMATION_BASE_PROJECT_RULES_ONLY
 int main(int argc, const char **argv) {
     // Configuring the command-line options
     llvm::cl::OptionCategory MyToolCategory("my-tool options");
@@ -92,24 +117,7 @@ int main(int argc, const char **argv) {
             cat("The name ``MkX`` is not allowed for functions; please rename")
     );
 
-    //Rule to rename the function rule
-    auto RenameInvalidFunctionNameRule = makeRule(
-            functionDecl(hasName("MkX")).bind("fun"),
-            changeTo(clang::transformer::name("fun"), cat("MakeX")),
-            cat("The name ``MkX`` is not allowed for functions; the function has been renamed")
-    );
-
-    //Rule to rename all expressions that calls the ``MkX`` function
-    auto RenameAllInvocationsOfInvalidFunctionNameRule =
-            makeRule(
-                    declRefExpr(to(functionDecl(hasName("MkX")))),
-                    changeTo(cat("MakeX")), cat("Referencing the invalid function ``MkX`` renaming to ``MakeX``")
-            );
-
-    //Combination of rules rename function and rename calls to function.
-    auto RenameFunctionAndAllInvocationsOfItRule =
-            clang::transformer::applyFirst(
-                    {RenameInvalidFunctionNameRule, RenameAllInvocationsOfInvalidFunctionNameRule});
+    auto RenameFunctionAndAllInvocationsOfItRule = makeRenameFunctionAndAllInvocationsOfItRule();
     MatchFinder Finder;
     MyConsumer Consumer(Tool.getReplacements());
     Transformer Transf{
@@ -145,4 +153,5 @@ int main(int argc, const char **argv) {
     Finder.addMatcher(FunMatcher, &Callback);
     // Outcomment line below and comment out the other Tool.runAndSave invocation to try the alternative way
 //    Tool.run(newFrontendActionFactory(&Finder).get());
-}
\ No newline at end of file
+}
+#endif
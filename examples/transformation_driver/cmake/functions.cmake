@@ -0,0 +1,76 @@
+function(force_env_or_flag var_name)
+# Checks if var_name exists as a CMake variable of system env variable. Sets the variable.
+    if (NOT ${var_name}) # Defined as CMake variable = do nothing
+        if (NOT "$ENV{${var_name}}" STREQUAL "") # Defined as env variable = set as CMake flag (if $ENV{${var_name}} != "")
+            set(${var_name} "$ENV{${var_name}}" PARENT_SCOPE)
+        else()
+            message(FATAL_ERROR "${var_name} is required to build project. Please configure as environment variable or specify -D${var_name}")
+        endif()
+    endif()
+endfunction()
+
+function(set_clang_lib llvm_build var_name)
+# Throws error if the folder ${llvm_build}/lib/clang doesn't exist
+# Sets var_name to point to ${llvm_build}/lib/clang
+if(IS_DIRECTORY "${llvm_build}/lib/clang")
+    set(${var_name} "${llvm_build}/lib/clang" CACHE INTERNAL "Configured lib/clang folder")
+else()
+    message(FATAL_ERROR "Unable to find ${llvm_build}/lib/clang. Aborting.")
+endif()
+endfunction()
+
+function(copy_lib_clang lib_clang)
+    message(STATUS "Copying ${lib_clang}/lib/clang to ${CMAKE_BINARY_DIR}/lib")
+    make_directory(${CMAKE_BINARY_DIR}/lib)
+    file(COPY ${lib_clang} DESTINATION "${CMAKE_BINARY_DIR}/lib")
+endfunction()
+
+function(configure_clang_lib)
+    force_env_or_flag("LLVM_BUILD")
+    message(STATUS "Using LLVM_BUILD = ${LLVM_BUILD}")
+    set_clang_lib("${LLVM_BUILD}" "LIB_CLANG")
+    message(STATUS "Using LIB_CLANG = ${LIB_CLANG}")
+    copy_lib_clang("${LIB_CLANG}")
+endfunction()
+
+function(configure_release_build target)
+# Applies the STATIC_LTO and PGO options to target:
+#  -DSTATIC_LTO=ON                  Link the clang and LLVM libraries statically
+#                                   with ThinLTO, and keep frame pointers and
+#                                   debug symbols so perf can unwind through
+#                                   the libraries.
+#  -DPGO=GENERATE                   Instrument target to write a profile
+#  -DPGO=USE -DPGO_PROFILE=<file>   Optimize target with a merged profile
+# LTO only reaches into the libraries if LLVM was built with
+# -DLLVM_ENABLE_LTO=Thin. See pgo.sh for the two-stage PGO build.
+    if (STATIC_LTO)
+        get_target_property(clang_lib_type clangAST TYPE)
+        if (LLVM_LINK_LLVM_DYLIB OR CLANG_LINK_CLANG_DYLIB OR NOT clang_lib_type STREQUAL "STATIC_LIBRARY")
+            message(FATAL_ERROR "STATIC_LTO requires static clang and LLVM libraries. Build LLVM without BUILD_SHARED_LIBS, LLVM_LINK_LLVM_DYLIB and CLANG_LINK_CLANG_DYLIB.")
+        endif()
+        target_compile_options(${target} PRIVATE -flto=thin -g -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer)
+        target_link_options(${target} PRIVATE -flto=thin -static-libstdc++ -static-libgcc)
+        find_program(LLD_LINKER ld.lld HINTS "${LLVM_TOOLS_BINARY_DIR}")
+        if (LLD_LINKER)
+            target_link_options(${target} PRIVATE "-fuse-ld=${LLD_LINKER}")
+        endif()
+        message(STATUS "Linking ${target} statically with ThinLTO")
+    endif()
+
+    if (PGO STREQUAL "GENERATE")
+        target_compile_options(${target} PRIVATE -fprofile-generate)
+        target_link_options(${target} PRIVATE -fprofile-generate)
+    elseif (PGO STREQUAL "USE")
+        if (NOT EXISTS "${PGO_PROFILE}")
+            message(FATAL_ERROR "PGO=USE requires -DPGO_PROFILE=<file.profdata>. Unable to find \"${PGO_PROFILE}\".")
+        endif()
+        # The profile is also needed when linking, since LTO optimizes there
+        target_compile_options(${target} PRIVATE "-fprofile-use=${PGO_PROFILE}")
+        target_link_options(${target} PRIVATE "-fprofile-use=${PGO_PROFILE}")
+    elseif (PGO)
+        message(FATAL_ERROR "Unknown PGO=${PGO}. Use GENERATE or USE.")
+    endif()
+    if (PGO)
+        message(STATUS "Using PGO=${PGO} for ${target}")
+    endif()
+endfunction()
@@ -0,0 +1,124 @@
+// Runs the rules of enum_to_string, the C-style array converter and the
+// transformation base project in one parse of each translation unit.
+//
+// The tools are included for their rules. The selected modules register their
+// rules on the one MatchFinder of enum_to_string, and feed its change set, so
+// selecting N modules costs one parse and not N. Takes the options of
+// enum_to_string, plus --modules and --pipeline.
+//
+// With --pipeline, the modules run one after the other instead, each on the
+// code rewritten by the ones before it. The rewritten code is kept in an
+// in-memory file system over the real one, so no stage writes or re-reads
+// the files, and nothing is written unless every stage succeeds.
+#define ENUM_TO_STRING_NO_MAIN
+#include "../enum_to_string/enum_to_string.cpp"
+
+#define C_STYLE_ARRAY_CONVERTER_RULES_ONLY
+#include "../c_style_array_converter/c_style_array_converter_tool.cpp"
+
+#define TRANSFORMATION_BASE_PROJECT_RULES_ONLY
+#include "../transformation_base_project/transformation_base_project.cpp"
+
+static llvm::cl::list<std::string> ModuleNames(
+	"modules",
+	llvm::cl::desc("Comma separated list of the modules to run: "
+				   "enum_to_string, c_style_array_converter and rename. Runs "
+				   "all of them if not specified."),
+	llvm::cl::CommaSeparated, llvm::cl::cat(MyToolCategory));
+static llvm::cl::opt<bool> Pipeline(
+	"pipeline",
+	llvm::cl::desc("Run the modules one after the other, in the order of "
+				   "--modules, each on the code rewritten by the modules "
+				   "before it. The code is only written once all modules "
+				   "succeeded."),
+	llvm::cl::cat(MyToolCategory));
+
+/// A selectable set of rules, one per tool. The rules list the tokens the
+/// prefilter looks for, see --prefilter. The rename rule also renames the
+/// functions declared in headers, so it lists none. Not called Module, as the
+/// tools bring clang::Module into scope.
+struct DriverModule {
+	StringRef Name;
+	std::vector<NamedRule> (*Rules)();
+};
+
+static const DriverModule Modules[] = {
+	{"enum_to_string",
+	 [] {
+		 return std::vector<NamedRule>{
+			 {"enumRule", makeEnumRule(), OutOfLine, {"enum"}}};
+	 }},
+	{"c_style_array_converter",
+	 [] {
+		 return std::vector<NamedRule>{
+			 {"FindArrays", makeFindArrays(), false, {"["}},
+			 {"FindCStyleArrayParams", makeFindCStyleArrayParams(), false,
+			  {"["}}};
+	 }},
+	{"rename",
+	 [] {
+		 return std::vector<NamedRule>{
+			 {"RenameFunctionAndAllInvocationsOfItRule",
+			  makeRenameFunctionAndAllInvocationsOfItRule()}};
+	 }},
+};
+
+int main(int argc, const char **argv) {
+	// The merge step of --shard takes no source files, which the normal
+	// option parsing requires
+	for (int I = 1; I < argc; ++I) {
+		StringRef Arg(argv[I]);
+		if (Arg.startswith("-merge=") || Arg.startswith("--merge=")) {
+			if (!llvm::cl::ParseCommandLineOptions(argc, argv, "",
+												   &llvm::errs())) {
+				return 1;
+			}
+			return mergeAndApply(MergeFiles);
+		}
+	}
+
+	auto ExpectedParser =
+		clang::tooling::CommonOptionsParser::create(argc, argv, MyToolCategory);
+	if (!ExpectedParser) {
+		// Fail gracefully for unsupported options.
+		llvm::errs() << ExpectedParser.takeError();
+		return 1;
+	}
+
+	for (const auto &Name : ModuleNames) {
+		if (llvm::none_of(Modules,
+						  [&](const auto &M) { return M.Name == Name; })) {
+			llvm::errs() << "Unknown module: " << Name << "\n";
+			return 1;
+		}
+	}
+
+	// One stage per module, in the order of --modules
+	if (Pipeline) {
+		std::vector<std::vector<NamedRule>> Stages;
+		if (ModuleNames.empty()) {
+			for (const auto &M : Modules) {
+				Stages.push_back(M.Rules());
+			}
+		}
+		for (const auto &Name : ModuleNames) {
+			Stages.push_back(llvm::find_if(Modules, [&](const auto &M) {
+								 return M.Name == Name;
+							 })->Rules());
+		}
+		return runPipeline(ExpectedParser.get(), "transformation_driver",
+						   Stages);
+	}
+
+	// The rules run in the order of Modules, whatever the order of --modules
+	std::vector<NamedRule> Rules;
+	for (const auto &M : Modules) {
+		if (ModuleNames.empty() || llvm::is_contained(ModuleNames, M.Name)) {
+			auto ModuleRules = M.Rules();
+			std::move(ModuleRules.begin(), ModuleRules.end(),
+					  std::back_inserter(Rules));
+		}
+	}
+
+	return run(ExpectedParser.get(), "transformation_driver", Rules);
+}